@@ -0,0 +1,506 @@
+/*
+ * equivalence-check.c
+ * Checks the fast parsing paths against the reference implementations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libideviceactivation.h>
+
+/* provided by the library when built with IDEVICE_ACTIVATION_TEST_HOOKS */
+idevice_activation_error_t idevice_activation_test_parse_buddyml(const char* content, size_t size, int use_xpath, idevice_activation_response_t* response);
+idevice_activation_error_t idevice_activation_test_plist_write_xml(plist_t node, char** xml, size_t* size);
+idevice_activation_error_t idevice_activation_test_parse_html_plist(const char* content, size_t size, int use_dump, plist_t* plist);
+
+#define NESTING_DEPTH 12
+
+#ifdef HAVE_PLIST_NEW_INT
+#define plist_new_signed(value) plist_new_int(value)
+#else
+/* libplist 2.2 has no signed integer nodes, the bits are stored as is */
+#define plist_new_signed(value) plist_new_uint((uint64_t) (value))
+#endif
+
+static int failures = 0;
+
+static void report(const char* name, const char* what, const char* walk, const char* xpath)
+{
+	printf("FAIL: %s: %s differs\n", name, what);
+	printf("  walk:  %s\n", (walk) ? walk : "(null)");
+	printf("  xpath: %s\n", (xpath) ? xpath : "(null)");
+	failures++;
+}
+
+static void compare_string(const char* name, const char* what, const char* walk, const char* xpath)
+{
+	if (!walk && !xpath)
+		return;
+	if (!walk || !xpath || strcmp(walk, xpath) != 0) {
+		report(name, what, walk, xpath);
+	}
+}
+
+static void compare_int(const char* name, const char* what, int walk, int xpath)
+{
+	char walk_str[16];
+	char xpath_str[16];
+
+	if (walk == xpath)
+		return;
+
+	snprintf(walk_str, sizeof(walk_str), "%d", walk);
+	snprintf(xpath_str, sizeof(xpath_str), "%d", xpath);
+	report(name, what, walk_str, xpath_str);
+}
+
+static void compare_field(const char* name, const char* key, idevice_activation_response_t walk, idevice_activation_response_t xpath)
+{
+	char what[256];
+	char* walk_value = NULL;
+	char* xpath_value = NULL;
+
+	snprintf(what, sizeof(what), "field %s", key);
+	idevice_activation_response_get_field(walk, key, &walk_value);
+	idevice_activation_response_get_field(xpath, key, &xpath_value);
+	compare_string(name, what, walk_value, xpath_value);
+	free(walk_value);
+	free(xpath_value);
+
+	snprintf(what, sizeof(what), "label of %s", key);
+	walk_value = xpath_value = NULL;
+	idevice_activation_response_get_label(walk, key, &walk_value);
+	idevice_activation_response_get_label(xpath, key, &xpath_value);
+	compare_string(name, what, walk_value, xpath_value);
+	free(walk_value);
+	free(xpath_value);
+
+	snprintf(what, sizeof(what), "placeholder of %s", key);
+	walk_value = xpath_value = NULL;
+	idevice_activation_response_get_placeholder(walk, key, &walk_value);
+	idevice_activation_response_get_placeholder(xpath, key, &xpath_value);
+	compare_string(name, what, walk_value, xpath_value);
+	free(walk_value);
+	free(xpath_value);
+
+	snprintf(what, sizeof(what), "required input of %s", key);
+	compare_int(name, what, idevice_activation_response_field_requires_input(walk, key), idevice_activation_response_field_requires_input(xpath, key));
+	snprintf(what, sizeof(what), "secure input of %s", key);
+	compare_int(name, what, idevice_activation_response_field_secure_input(walk, key), idevice_activation_response_field_secure_input(xpath, key));
+}
+
+static void compare_fields(const char* name, idevice_activation_response_t walk, idevice_activation_response_t xpath)
+{
+	plist_t walk_fields = NULL;
+	plist_t xpath_fields = NULL;
+	plist_dict_iter iter = NULL;
+	char* key = NULL;
+	plist_t node = NULL;
+
+	idevice_activation_response_get_fields(walk, &walk_fields);
+	idevice_activation_response_get_fields(xpath, &xpath_fields);
+	compare_int(name, "number of fields", (walk_fields) ? (int) plist_dict_get_size(walk_fields) : 0, (xpath_fields) ? (int) plist_dict_get_size(xpath_fields) : 0);
+
+	// every key of one side is looked up on the other one, together with
+	// the equal count this covers both directions
+	if (walk_fields) {
+		plist_dict_new_iter(walk_fields, &iter);
+	}
+	if (iter) {
+		do {
+			key = NULL;
+			node = NULL;
+			plist_dict_next_item(walk_fields, iter, &key, &node);
+			if (key) {
+				compare_field(name, key, walk, xpath);
+				free(key);
+			}
+		} while (node);
+		free(iter);
+	}
+
+	plist_free(walk_fields);
+	plist_free(xpath_fields);
+}
+
+static int read_file(const char* filename, char** content, size_t* size)
+{
+	FILE* f = fopen(filename, "rb");
+	long length = 0;
+
+	if (!f) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (length < 0) {
+		fclose(f);
+		return -1;
+	}
+
+	*content = (char*) malloc(length + 1);
+	if (!*content || fread(*content, 1, length, f) != (size_t)length) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		free(*content);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	(*content)[length] = '\0';
+	*size = length;
+
+	return 0;
+}
+
+/* The buddyml tree walk has to produce the same response as the XPath
+ * based parser it replaced. */
+static void check_buddyml(const char* filename)
+{
+	const char* name = strrchr(filename, '/');
+	idevice_activation_response_t walk = NULL;
+	idevice_activation_response_t xpath = NULL;
+	idevice_activation_error_t walk_result;
+	idevice_activation_error_t xpath_result;
+	const char* walk_str = NULL;
+	const char* xpath_str = NULL;
+	char* content = NULL;
+	size_t size = 0;
+	int before = failures;
+
+	name = (name) ? name + 1 : filename;
+	if (read_file(filename, &content, &size) < 0) {
+		failures++;
+		return;
+	}
+
+	walk_result = idevice_activation_test_parse_buddyml(content, size, 0, &walk);
+	xpath_result = idevice_activation_test_parse_buddyml(content, size, 1, &xpath);
+	free(content);
+	if (!walk || !xpath) {
+		printf("FAIL: %s: could not create the responses\n", name);
+		failures++;
+		idevice_activation_response_free(walk);
+		idevice_activation_response_free(xpath);
+		return;
+	}
+
+	compare_int(name, "result", walk_result, xpath_result);
+	if (walk_result != IDEVICE_ACTIVATION_E_SUCCESS || xpath_result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		// what a failed parse left in the response is not part of the contract
+		goto cleanup;
+	}
+
+	idevice_activation_response_get_title(walk, &walk_str);
+	idevice_activation_response_get_title(xpath, &xpath_str);
+	compare_string(name, "title", walk_str, xpath_str);
+
+	walk_str = xpath_str = NULL;
+	idevice_activation_response_get_description(walk, &walk_str);
+	idevice_activation_response_get_description(xpath, &xpath_str);
+	compare_string(name, "description", walk_str, xpath_str);
+
+	compare_int(name, "activation ack", idevice_activation_response_is_activation_acknowledged(walk), idevice_activation_response_is_activation_acknowledged(xpath));
+	compare_int(name, "authentication required", idevice_activation_response_is_authentication_required(walk), idevice_activation_response_is_authentication_required(xpath));
+	compare_int(name, "errors", idevice_activation_response_has_errors(walk), idevice_activation_response_has_errors(xpath));
+	compare_int(name, "activation record", idevice_activation_response_borrow_activation_record(walk) != NULL, idevice_activation_response_borrow_activation_record(xpath) != NULL);
+	compare_fields(name, walk, xpath);
+
+cleanup:
+	if (failures == before) {
+		printf("PASS: %s\n", name);
+	}
+
+	idevice_activation_response_free(walk);
+	idevice_activation_response_free(xpath);
+}
+
+/* What the library did before it had its own writer: a full document
+ * from plist_to_xml() with everything outside the <plist> tags cut off */
+static char* plist_to_xml_fragment(plist_t node, size_t* size)
+{
+	char* xml = NULL;
+	uint32_t xml_size = 0;
+	const char* start = NULL;
+	const char* stop = NULL;
+	char* fragment = NULL;
+
+	plist_to_xml(node, &xml, &xml_size);
+	if (!xml)
+		return NULL;
+
+	start = strstr(xml, "<plist version=\"1.0\">\n");
+	stop = strstr(xml, "\n</plist>");
+	if (start && stop) {
+		start += strlen("<plist version=\"1.0\">\n");
+	}
+	if (!start || !stop || stop < start) {
+		free(xml);
+		return NULL;
+	}
+
+	*size = stop - start;
+	fragment = (char*) malloc(*size + 1);
+	if (fragment) {
+		memcpy(fragment, start, *size);
+		fragment[*size] = '\0';
+	}
+	free(xml);
+
+	return fragment;
+}
+
+static void check_plist_node(const char* name, plist_t node)
+{
+	char* expected = NULL;
+	char* actual = NULL;
+	size_t expected_size = 0;
+	size_t actual_size = 0;
+	idevice_activation_error_t result;
+
+	expected = plist_to_xml_fragment(node, &expected_size);
+	result = idevice_activation_test_plist_write_xml(node, &actual, &actual_size);
+	if (!expected || result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		printf("FAIL: plist %s: could not serialize (error %d)\n", name, result);
+		failures++;
+	} else if (expected_size != actual_size || memcmp(expected, actual, expected_size) != 0) {
+		printf("FAIL: plist %s: output differs from plist_to_xml()\n", name);
+		printf("--- plist_to_xml\n%s\n--- writer\n%s\n---\n", expected, actual);
+		failures++;
+	} else {
+		printf("PASS: plist %s\n", name);
+	}
+
+	free(expected);
+	free(actual);
+}
+
+/* Checks node on its own, as a dict value and nested so deep that the
+ * indentation of data is capped. */
+static void check_plist(const char* name, plist_t node)
+{
+	char nested_name[128];
+	plist_t dict = NULL;
+	plist_t nested = NULL;
+	int i;
+
+	check_plist_node(name, node);
+
+	snprintf(nested_name, sizeof(nested_name), "%s in dict", name);
+	dict = plist_new_dict();
+	plist_dict_set_item(dict, "value", plist_copy(node));
+	plist_dict_set_item(dict, "a<b>&c", plist_copy(node));
+	check_plist_node(nested_name, dict);
+	plist_free(dict);
+
+	snprintf(nested_name, sizeof(nested_name), "%s at depth %d", name, NESTING_DEPTH);
+	nested = plist_copy(node);
+	for (i = 0; i < NESTING_DEPTH; i++) {
+		plist_t parent = NULL;
+		if (i % 2) {
+			parent = plist_new_dict();
+			plist_dict_set_item(parent, "key", nested);
+		} else {
+			parent = plist_new_array();
+			plist_array_append_item(parent, nested);
+		}
+		nested = parent;
+	}
+	check_plist_node(nested_name, nested);
+	plist_free(nested);
+
+	plist_free(node);
+}
+
+/* The HTML activation record is built straight from the DOM, it has to
+ * match what htmlNodeDump() and plist_from_xml() produced. Both the XML
+ * and the binary form are compared, the latter keeps integer signedness
+ * even where the XML text is the same. */
+static void check_html_plist(const char* filename)
+{
+	const char* name = strrchr(filename, '/');
+	idevice_activation_error_t dom_result;
+	idevice_activation_error_t dump_result;
+	plist_t dom = NULL;
+	plist_t dump = NULL;
+	char* dom_str = NULL;
+	char* dump_str = NULL;
+	uint32_t dom_size = 0;
+	uint32_t dump_size = 0;
+	char* content = NULL;
+	size_t size = 0;
+
+	name = (name) ? name + 1 : filename;
+	if (read_file(filename, &content, &size) < 0) {
+		failures++;
+		return;
+	}
+
+	dom_result = idevice_activation_test_parse_html_plist(content, size, 0, &dom);
+	dump_result = idevice_activation_test_parse_html_plist(content, size, 1, &dump);
+	free(content);
+
+	if (dom_result != IDEVICE_ACTIVATION_E_SUCCESS || dump_result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		compare_int(name, "result", dom_result, dump_result);
+		if (dom_result == dump_result) {
+			printf("PASS: %s (no plist)\n", name);
+		}
+		plist_free(dom);
+		plist_free(dump);
+		return;
+	}
+
+	plist_to_xml(dom, &dom_str, &dom_size);
+	plist_to_xml(dump, &dump_str, &dump_size);
+	if (!dom_str || !dump_str || dom_size != dump_size || memcmp(dom_str, dump_str, dom_size) != 0) {
+		printf("FAIL: %s: plist differs from plist_from_xml()\n", name);
+		printf("--- plist_from_xml\n%s\n--- DOM\n%s\n---\n", (dump_str) ? dump_str : "(null)", (dom_str) ? dom_str : "(null)");
+		failures++;
+	} else {
+		free(dom_str);
+		free(dump_str);
+		dom_str = dump_str = NULL;
+		plist_to_bin(dom, &dom_str, &dom_size);
+		plist_to_bin(dump, &dump_str, &dump_size);
+		if (dom_size != dump_size || (dom_size && memcmp(dom_str, dump_str, dom_size) != 0)) {
+			printf("FAIL: %s: binary plist differs from plist_from_xml()\n", name);
+			failures++;
+		} else {
+			printf("PASS: %s\n", name);
+		}
+	}
+
+	free(dom_str);
+	free(dump_str);
+	plist_free(dom);
+	plist_free(dump);
+}
+
+/* The XML writer for request field values has to produce exactly what
+ * plist_to_xml() put between the <plist> tags. */
+static void check_plist_writer(void)
+{
+	const char negative[] = "<plist version=\"1.0\"><integer>-5</integer></plist>";
+	char data[256];
+	plist_t node = NULL;
+	int i;
+
+	for (i = 0; i < (int) sizeof(data); i++) {
+		data[i] = (char) i;
+	}
+
+	check_plist("true", plist_new_bool(1));
+	check_plist("false", plist_new_bool(0));
+	check_plist("integer 0", plist_new_uint(0));
+	check_plist("integer 42", plist_new_uint(42));
+	check_plist("integer INT64_MAX", plist_new_uint(INT64_MAX));
+	check_plist("integer above INT64_MAX", plist_new_uint((uint64_t) INT64_MAX + 1));
+	check_plist("integer UINT64_MAX", plist_new_uint(UINT64_MAX));
+	check_plist("integer -1", plist_new_signed(-1));
+	check_plist("integer INT64_MIN", plist_new_signed(INT64_MIN));
+
+	node = NULL;
+	plist_from_xml(negative, strlen(negative), &node);
+	if (!node) {
+		printf("FAIL: plist parsed integer -5: plist_from_xml() failed\n");
+		failures++;
+	} else {
+		check_plist("parsed integer -5", node);
+	}
+
+	check_plist("real 0", plist_new_real(0.0));
+	check_plist("real 1.5", plist_new_real(1.5));
+	check_plist("real -0.1", plist_new_real(-0.1));
+	check_plist("real 1e300", plist_new_real(1e300));
+	check_plist("real 1/3", plist_new_real(1.0 / 3.0));
+	check_plist("string", plist_new_string("activation"));
+	check_plist("empty string", plist_new_string(""));
+	check_plist("string with entities", plist_new_string("<a href=\"x\">&amp; 'y'</a>"));
+	check_plist("date 2001", plist_new_date(0, 0));
+	check_plist("date 1970", plist_new_date(-978307200, 0));
+	check_plist("date 2026", plist_new_date(805000000, 0));
+	check_plist("empty data", plist_new_data(data, 0));
+	check_plist("data 1 byte", plist_new_data(data, 1));
+	check_plist("data 2 bytes", plist_new_data(data, 2));
+	check_plist("data 3 bytes", plist_new_data(data, 3));
+	check_plist("data 57 bytes", plist_new_data(data, 57));
+	check_plist("data 256 bytes", plist_new_data(data, sizeof(data)));
+	check_plist("uid", plist_new_uid(7));
+	check_plist("empty array", plist_new_array());
+	check_plist("empty dict", plist_new_dict());
+
+	node = plist_new_dict();
+	plist_dict_set_item(node, "ActivationRandomness", plist_new_string("5A1C2F8E"));
+	plist_dict_set_item(node, "ActivationRequiresActivationTicket", plist_new_bool(1));
+	plist_dict_set_item(node, "DeviceCertRequest", plist_new_data(data, 200));
+	plist_dict_set_item(node, "Empty", plist_new_array());
+	check_plist("activation info", node);
+}
+
+static void print_usage(const char* argv0)
+{
+	const char* name = strrchr(argv0, '/');
+	printf("Usage: %s [OPTIONS] [FILE...]\n", (name ? name + 1 : argv0));
+	printf("\n");
+	printf("Compare the buddyml tree walk with the XPath based parser on each\n");
+	printf(".buddyml FILE and the plist read from the DOM with plist_from_xml()\n");
+	printf("on each .html FILE, other files are skipped. The XML writer for\n");
+	printf("request fields is compared with plist_to_xml() on a fixed set of\n");
+	printf("values.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		const char* ext = strrchr(argv[i], '.');
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argv[0]);
+			return EXIT_SUCCESS;
+		} else if (argv[i][0] == '-') {
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		} else if (ext && !strcmp(ext, ".buddyml")) {
+			check_buddyml(argv[i]);
+		} else if (ext && !strcmp(ext, ".html")) {
+			check_html_plist(argv[i]);
+		}
+	}
+
+	check_plist_writer();
+
+	if (failures > 0) {
+		printf("%d difference(s) found\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
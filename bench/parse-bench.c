@@ -0,0 +1,480 @@
+/*
+ * parse-bench.c
+ * Benchmark for the activation response parsers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <libideviceactivation.h>
+
+/* provided by the library when built with IDEVICE_ACTIVATION_TEST_HOOKS */
+idevice_activation_error_t idevice_activation_test_parse_raw_response(const char* content, size_t size, const char* content_type, idevice_activation_response_t* response);
+
+#define DEFAULT_MIN_SECONDS 0.5
+#define DEFAULT_MIN_ITERATIONS 20
+
+#ifdef __GLIBC__
+/* count allocations by interposing the glibc allocator, this covers
+ * libxml2, libplist and curl as well. strdup() and friends allocate
+ * through malloc() inside glibc, the aligned variants are counted here. */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+#define HAVE_ALLOC_COUNTERS 1
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+void* malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+static void* counted_memalign(size_t alignment, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	return counted_memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+	void* ptr = NULL;
+
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	ptr = counted_memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+struct bench_case {
+	char* name;
+	const char* content_type;
+	char* content;
+	size_t size;
+};
+
+struct buffer {
+	char* data;
+	size_t size;
+	size_t capacity;
+};
+
+static void buffer_append(struct buffer* buf, const char* str, size_t len)
+{
+	if (buf->size + len + 1 > buf->capacity) {
+		size_t capacity = (buf->capacity > 0) ? buf->capacity : 4096;
+		while (capacity < buf->size + len + 1) {
+			capacity *= 2;
+		}
+		buf->data = (char*) realloc(buf->data, capacity);
+		if (!buf->data) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->size, str, len);
+	buf->size += len;
+	buf->data[buf->size] = '\0';
+}
+
+static void buffer_puts(struct buffer* buf, const char* str)
+{
+	buffer_append(buf, str, strlen(str));
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static long get_peak_rss_kb(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return -1;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+static const char* content_type_for_file(const char* filename)
+{
+	const char* ext = strrchr(filename, '.');
+	if (!ext)
+		return NULL;
+
+	if (!strcmp(ext, ".buddyml"))
+		return "application/x-buddyml";
+	if (!strcmp(ext, ".html"))
+		return "text/html";
+	if (!strcmp(ext, ".plist"))
+		return "application/xml";
+	if (!strcmp(ext, ".bplist"))
+		return "application/x-bplist";
+
+	// let the library sniff the content
+	return NULL;
+}
+
+static int load_case(const char* filename, struct bench_case* bc)
+{
+	FILE* f = fopen(filename, "rb");
+	const char* basename = strrchr(filename, '/');
+	long size = 0;
+
+	if (!f) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size < 0) {
+		fclose(f);
+		return -1;
+	}
+
+	bc->content = (char*) malloc(size + 1);
+	if (!bc->content || fread(bc->content, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		free(bc->content);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	bc->content[size] = '\0';
+	bc->size = size;
+	bc->name = strdup((basename) ? basename + 1 : filename);
+	bc->content_type = content_type_for_file(filename);
+
+	return 0;
+}
+
+/* the recorded corpus only has small and medium sized replies, larger
+ * ones are generated in the same shape */
+
+static void append_base64_blob(struct buffer* buf, unsigned int seed, size_t size, const char* indent)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char line[80];
+	size_t i = 0;
+
+	while (i < size) {
+		size_t n = 0;
+		for (n = 0; n < 68 && i < size; n += 4, i += 3) {
+			seed = seed * 1103515245 + 12345;
+			line[n] = alphabet[(seed >> 8) & 63];
+			line[n + 1] = alphabet[(seed >> 14) & 63];
+			line[n + 2] = alphabet[(seed >> 20) & 63];
+			line[n + 3] = alphabet[(seed >> 26) & 63];
+		}
+		buffer_puts(buf, indent);
+		buffer_append(buf, line, n);
+		buffer_puts(buf, "\n");
+	}
+}
+
+static void append_record_dict(struct buffer* buf, size_t size, const char* indent)
+{
+	char tmp[128];
+	unsigned int i = 0;
+
+	buffer_puts(buf, indent);
+	buffer_puts(buf, "<dict>\n");
+	buffer_puts(buf, indent);
+	buffer_puts(buf, "\t<key>ack-received</key>\n");
+	buffer_puts(buf, indent);
+	buffer_puts(buf, "\t<true/>\n");
+	for (i = 0; buf->size < size; i++) {
+		snprintf(tmp, sizeof(tmp), "%s\t<key>Blob%u</key>\n%s\t<data>\n", indent, i, indent);
+		buffer_puts(buf, tmp);
+		snprintf(tmp, sizeof(tmp), "%s\t", indent);
+		append_base64_blob(buf, i, 4096, tmp);
+		buffer_puts(buf, indent);
+		buffer_puts(buf, "\t</data>\n");
+	}
+	buffer_puts(buf, indent);
+	buffer_puts(buf, "</dict>\n");
+}
+
+static void synth_record_plist(struct bench_case* bc, size_t size)
+{
+	struct buffer buf = { NULL, 0, 0 };
+	char name[64];
+
+	buffer_puts(&buf, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n<plist version=\"1.0\">\n<dict>\n\t<key>ActivationRecord</key>\n");
+	append_record_dict(&buf, size, "\t");
+	buffer_puts(&buf, "</dict>\n</plist>\n");
+
+	snprintf(name, sizeof(name), "synthetic-record-%zuk.plist", size / 1024);
+	bc->name = strdup(name);
+	bc->content_type = "application/xml";
+	bc->content = buf.data;
+	bc->size = buf.size;
+}
+
+static void synth_record_html(struct bench_case* bc, size_t size)
+{
+	struct buffer buf = { NULL, 0, 0 };
+	char name[64];
+
+	buffer_puts(&buf, "<!DOCTYPE html>\n<html>\n<head>\n<title>iPhone Activation</title>\n<script id=\"protocol\" type=\"text/x-apple-plist\"><plist version=\"1.0\">\n<dict>\n\t<key>iphone-activation</key>\n\t<dict>\n\t\t<key>ack-received</key>\n\t\t<true/>\n\t\t<key>activation-record</key>\n");
+	append_record_dict(&buf, size, "\t\t");
+	buffer_puts(&buf, "\t</dict>\n</dict>\n</plist></script>\n</head>\n<body></body>\n</html>\n");
+
+	snprintf(name, sizeof(name), "synthetic-record-%zuk.html", size / 1024);
+	bc->name = strdup(name);
+	bc->content_type = "text/html";
+	bc->content = buf.data;
+	bc->size = buf.size;
+}
+
+static void synth_fields_buddyml(struct bench_case* bc, size_t size)
+{
+	struct buffer buf = { NULL, 0, 0 };
+	char tmp[256];
+	char name[64];
+	unsigned int i = 0;
+
+	buffer_puts(&buf, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<xmlui style=\"setupAssistant\">\n  <page>\n    <navigationBar title=\"Activation Lock\" hidesBackButton=\"false\"/>\n    <tableView>\n");
+	for (i = 0; buf.size < size; i++) {
+		snprintf(tmp, sizeof(tmp), "      <section>\n        <footer>Footer text of section %u, sign in with the Apple ID that was used to set up this device.</footer>\n", i);
+		buffer_puts(&buf, tmp);
+		snprintf(tmp, sizeof(tmp), "        <editableTextRow id=\"field%u\" label=\"Field %u\" placeholder=\"Required\" secure=\"%s\"/>\n      </section>\n", i, i, (i % 2) ? "true" : "false");
+		buffer_puts(&buf, tmp);
+	}
+	buffer_puts(&buf, "    </tableView>\n  </page>\n  <serverInfo isAuthRequired=\"true\" dsid=\"1234567890\"/>\n</xmlui>\n");
+
+	snprintf(name, sizeof(name), "synthetic-fields-%zuk.buddyml", size / 1024);
+	bc->name = strdup(name);
+	bc->content_type = "application/x-buddyml";
+	bc->content = buf.data;
+	bc->size = buf.size;
+}
+
+static void print_json_string(const char* str)
+{
+	putchar('"');
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			putchar('\\');
+			putchar(*str);
+		} else if ((unsigned char)*str < 0x20) {
+			printf("\\u%04x", (unsigned char)*str);
+		} else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+static int run_case(struct bench_case* bc, double min_seconds, unsigned int min_iterations)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	uint64_t iterations = 0;
+	double start = 0;
+	double elapsed = 0;
+#ifdef HAVE_ALLOC_COUNTERS
+	uint64_t allocs_before = 0;
+	uint64_t bytes_before = 0;
+	uint64_t allocs = 0;
+	uint64_t bytes = 0;
+#endif
+
+	// warm up, and make sure the case parses at all
+	idevice_activation_response_t response = NULL;
+	result = idevice_activation_test_parse_raw_response(bc->content, bc->size, bc->content_type, &response);
+	idevice_activation_response_free(response);
+
+#ifdef HAVE_ALLOC_COUNTERS
+	allocs_before = alloc_count;
+	bytes_before = alloc_bytes;
+	response = NULL;
+	idevice_activation_test_parse_raw_response(bc->content, bc->size, bc->content_type, &response);
+	idevice_activation_response_free(response);
+	allocs = alloc_count - allocs_before;
+	bytes = alloc_bytes - bytes_before;
+#endif
+
+	start = get_time();
+	do {
+		response = NULL;
+		idevice_activation_test_parse_raw_response(bc->content, bc->size, bc->content_type, &response);
+		idevice_activation_response_free(response);
+		iterations++;
+		elapsed = get_time() - start;
+	} while (elapsed < min_seconds || iterations < min_iterations);
+
+	printf("{\"name\":");
+	print_json_string(bc->name);
+	printf(",\"content_type\":");
+	if (bc->content_type) {
+		print_json_string(bc->content_type);
+	} else {
+		printf("null");
+	}
+	printf(",\"bytes\":%zu,\"result\":%d,\"iterations\":%llu,\"seconds\":%.6f", bc->size, result, (unsigned long long)iterations, elapsed);
+	printf(",\"parses_per_sec\":%.1f,\"ns_per_byte\":%.3f", (double)iterations / elapsed, (bc->size > 0) ? (elapsed * 1000000000.0) / ((double)iterations * (double)bc->size) : 0.0);
+#ifdef HAVE_ALLOC_COUNTERS
+	printf(",\"allocs_per_parse\":%llu,\"alloc_bytes_per_parse\":%llu", (unsigned long long)allocs, (unsigned long long)bytes);
+#else
+	printf(",\"allocs_per_parse\":null,\"alloc_bytes_per_parse\":null");
+#endif
+	printf(",\"peak_rss_kb\":%ld}\n", get_peak_rss_kb());
+	fflush(stdout);
+
+	return (result == IDEVICE_ACTIVATION_E_SUCCESS) ? 0 : -1;
+}
+
+static void print_usage(const char* argv0)
+{
+	const char* name = strrchr(argv0, '/');
+	printf("Usage: %s [OPTIONS] [FILE...]\n", (name ? name + 1 : argv0));
+	printf("\n");
+	printf("Run the activation response parsers over a corpus of recorded replies\n");
+	printf("and print one JSON object per reply.\n");
+	printf("\n");
+	printf("The content type is taken from the file extension: .buddyml, .html,\n");
+	printf(".plist and .bplist, anything else is left to content sniffing.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -t, --time SECONDS\tminimum run time per reply (default %.1f)\n", DEFAULT_MIN_SECONDS);
+	printf("  -n, --iterations N\tminimum number of parses per reply (default %d)\n", DEFAULT_MIN_ITERATIONS);
+	printf("  -s, --no-synthetic\tskip the generated large replies\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_case* cases = NULL;
+	int num_cases = 0;
+	double min_seconds = DEFAULT_MIN_SECONDS;
+	unsigned int min_iterations = DEFAULT_MIN_ITERATIONS;
+	int synthetic = 1;
+	int failed = 0;
+	int i;
+
+	cases = (struct bench_case*) calloc(argc + 6, sizeof(struct bench_case));
+	if (!cases) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--time")) && i + 1 < argc) {
+			min_seconds = atof(argv[++i]);
+		} else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--iterations")) && i + 1 < argc) {
+			min_iterations = (unsigned int) strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--no-synthetic")) {
+			synthetic = 0;
+		} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argv[0]);
+			free(cases);
+			return EXIT_SUCCESS;
+		} else if (argv[i][0] == '-') {
+			print_usage(argv[0]);
+			free(cases);
+			return EXIT_FAILURE;
+		} else {
+			if (load_case(argv[i], &cases[num_cases]) < 0) {
+				failed = 1;
+				continue;
+			}
+			num_cases++;
+		}
+	}
+
+	if (synthetic) {
+		synth_record_plist(&cases[num_cases++], 256 * 1024);
+		synth_record_plist(&cases[num_cases++], 768 * 1024);
+		synth_record_html(&cases[num_cases++], 256 * 1024);
+		synth_record_html(&cases[num_cases++], 768 * 1024);
+		synth_fields_buddyml(&cases[num_cases++], 128 * 1024);
+	}
+
+	printf("{\"benchmark\":\"parse\"");
+#ifdef PACKAGE_VERSION
+	printf(",\"version\":\"%s\"", PACKAGE_VERSION);
+#endif
+	printf(",\"min_seconds\":%.3f,\"min_iterations\":%u}\n", min_seconds, min_iterations);
+
+	for (i = 0; i < num_cases; i++) {
+		if (run_case(&cases[i], min_seconds, min_iterations) < 0) {
+			failed = 1;
+		}
+		free(cases[i].name);
+		free(cases[i].content);
+	}
+	free(cases);
+
+	return (failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
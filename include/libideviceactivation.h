@@ -50,6 +50,10 @@ typedef enum {
 	IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR    = -5,
 	IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR     = -6,
 	IDEVICE_ACTIVATION_E_UNSUPPORTED_FIELD_TYPE = -7,
+	IDEVICE_ACTIVATION_E_NOT_SUPPORTED          = -8,
+	IDEVICE_ACTIVATION_E_CONNECTION_FAILED      = -9,
+	IDEVICE_ACTIVATION_E_TIMEOUT                = -10,
+	IDEVICE_ACTIVATION_E_CANCELLED              = -11,
 	IDEVICE_ACTIVATION_E_INTERNAL_ERROR         = -255
 } idevice_activation_error_t;
 
@@ -58,10 +62,62 @@ typedef enum {
 	IDEVICE_ACTIVATION_CLIENT_ITUNES
 } idevice_activation_client_type_t;
 
+typedef enum {
+	IDEVICE_ACTIVATION_PLIST_FORMAT_XML,
+	IDEVICE_ACTIVATION_PLIST_FORMAT_BINARY
+} idevice_activation_plist_format_t;
+
+/* CONNECT_FAILURE and RETRY_AFTER are the subsets of CONNECTION_ERROR and
+ * SERVER_ERROR where the server did not act on the request, they are the
+ * only safe ones for requests that must not be sent twice. */
+typedef enum {
+	IDEVICE_ACTIVATION_RETRY_ON_CONNECTION_ERROR = 1 << 0,
+	IDEVICE_ACTIVATION_RETRY_ON_TIMEOUT          = 1 << 1,
+	IDEVICE_ACTIVATION_RETRY_ON_SERVER_ERROR     = 1 << 2, /* HTTP 5xx and 429 */
+	IDEVICE_ACTIVATION_RETRY_ON_EMPTY_RESPONSE   = 1 << 3,
+	IDEVICE_ACTIVATION_RETRY_ON_CONNECT_FAILURE  = 1 << 4, /* DNS lookup or connect failed */
+	IDEVICE_ACTIVATION_RETRY_ON_RETRY_AFTER      = 1 << 5, /* HTTP 503 and 429 with Retry-After */
+	IDEVICE_ACTIVATION_RETRY_ON_ALL              = 0x3F
+} idevice_activation_retry_class_t;
+
+typedef struct {
+	unsigned int max_attempts;    /* including the first one, 0 or 1 disables retries */
+	unsigned int base_backoff_ms;
+	unsigned int max_backoff_ms;  /* 0 for no limit, Retry-After is still capped at 5 minutes */
+	unsigned int retry_on;        /* mask of idevice_activation_retry_class_t */
+} idevice_activation_retry_policy_t;
+
+/* Network timings in seconds, measured from the start of the transfer as
+ * reported by libcurl, plus the time spent parsing the response body. */
+typedef struct {
+	double namelookup;
+	double connect;
+	double appconnect;
+	double pretransfer;
+	double starttransfer;
+	double total;
+	double parse;
+	uint64_t bytes_uploaded;
+	uint64_t bytes_downloaded;
+} idevice_activation_timings_t;
+
 typedef struct idevice_activation_request_private idevice_activation_request;
 typedef idevice_activation_request* idevice_activation_request_t;
+typedef struct idevice_activation_request_template_private idevice_activation_request_template;
+typedef idevice_activation_request_template* idevice_activation_request_template_t;
 typedef struct idevice_activation_response_private idevice_activation_response;
 typedef idevice_activation_response* idevice_activation_response_t;
+typedef struct idevice_activation_session_private idevice_activation_session;
+typedef idevice_activation_session* idevice_activation_session_t;
+typedef struct idevice_activation_cancel_private idevice_activation_cancel;
+typedef idevice_activation_cancel* idevice_activation_cancel_t;
+typedef struct idevice_activation_multi_private idevice_activation_multi;
+typedef idevice_activation_multi* idevice_activation_multi_t;
+
+/* Called when an asynchronous request completes. On success the callee owns
+ * the response and has to free it with idevice_activation_response_free(),
+ * otherwise response is NULL and error holds the reason. */
+typedef void (*idevice_activation_request_cb_t)(idevice_activation_request_t request, idevice_activation_error_t error, idevice_activation_response_t response, void* userdata);
 
 /* Interface */
 
@@ -72,6 +128,17 @@ IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_request_new
 IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_drm_handshake_request_new(idevice_activation_client_type_t client_type, idevice_activation_request_t* request);
 IDEVICE_ACTIVATION_API void idevice_activation_request_free(idevice_activation_request_t request);
 
+/* A template is a snapshot of a configured request, including its fields
+ * and serialized body. Requests forked from it share both until they
+ * overwrite one of the template fields, fields set on a forked request are
+ * serialized after the shared ones. The cancel handle is not part of the
+ * snapshot, each fork has to get its own with request_set_cancel(). The
+ * template may be freed while forked requests are still around, forking
+ * is safe from several threads. */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_request_template_new(idevice_activation_request_t request, idevice_activation_request_template_t* request_template);
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_request_new_from_template(idevice_activation_request_template_t request_template, idevice_activation_request_t* request);
+IDEVICE_ACTIVATION_API void idevice_activation_request_template_free(idevice_activation_request_template_t request_template);
+
 IDEVICE_ACTIVATION_API void idevice_activation_request_get_fields(idevice_activation_request_t request, plist_t* fields);
 IDEVICE_ACTIVATION_API void idevice_activation_request_set_fields(idevice_activation_request_t request, plist_t fields);
 IDEVICE_ACTIVATION_API void idevice_activation_request_set_fields_from_response(idevice_activation_request_t request, const idevice_activation_response_t response);
@@ -81,10 +148,36 @@ IDEVICE_ACTIVATION_API void idevice_activation_request_get_field(idevice_activat
 IDEVICE_ACTIVATION_API void idevice_activation_request_get_url(idevice_activation_request_t request, const char** url);
 IDEVICE_ACTIVATION_API void idevice_activation_request_set_url(idevice_activation_request_t request, const char* url);
 
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_compression(idevice_activation_request_t request, int enable);
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_streaming_parse(idevice_activation_request_t request, int enable);
+/* Format of plist request bodies (drmHandshake), binary plist replies are accepted either way. */
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_plist_format(idevice_activation_request_t request, idevice_activation_plist_format_t format);
+/* With lazy parsing the response body is only parsed when one of the
+ * response getters first needs it. Parse errors are then reported by
+ * idevice_activation_response_parse() instead of the send functions. */
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_lazy_parse(idevice_activation_request_t request, int enable);
+/* Serializes the request body and keeps it with the request, sends reuse it
+ * until the fields or the plist format change. Calling this is optional, it
+ * moves the work and any serialization error ahead of the first send.
+ * The request must not be modified while a send using it is in progress. */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_request_serialize(idevice_activation_request_t request);
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_timeouts(idevice_activation_request_t request, long connect_timeout_ms, long timeout_ms);
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_retry_policy(idevice_activation_request_t request, const idevice_activation_retry_policy_t* policy);
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_low_speed_limit(idevice_activation_request_t request, long bytes_per_second, long seconds);
+/* The cancel handle is not owned by the request and has to outlive it. */
+IDEVICE_ACTIVATION_API void idevice_activation_request_set_cancel(idevice_activation_request_t request, idevice_activation_cancel_t cancel);
+
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_cancel_new(idevice_activation_cancel_t* cancel);
+IDEVICE_ACTIVATION_API void idevice_activation_cancel_free(idevice_activation_cancel_t cancel);
+IDEVICE_ACTIVATION_API void idevice_activation_cancel_trigger(idevice_activation_cancel_t cancel);
+IDEVICE_ACTIVATION_API void idevice_activation_cancel_reset(idevice_activation_cancel_t cancel);
+IDEVICE_ACTIVATION_API int idevice_activation_cancel_is_triggered(idevice_activation_cancel_t cancel);
+
 IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_response_new(idevice_activation_response_t* response);
 IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_response_new_from_html(const char* content, idevice_activation_response_t* response);
 IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_response_to_buffer(idevice_activation_response_t response, char** buffer, size_t* size);
 IDEVICE_ACTIVATION_API void idevice_activation_response_free(idevice_activation_response_t response);
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_response_parse(idevice_activation_response_t response);
 
 IDEVICE_ACTIVATION_API void idevice_activation_response_get_field(idevice_activation_response_t response, const char* key, char** value);
 IDEVICE_ACTIVATION_API void idevice_activation_response_get_fields(idevice_activation_response_t response, plist_t* fields);
@@ -94,7 +187,22 @@ IDEVICE_ACTIVATION_API void idevice_activation_response_get_placeholder(idevice_
 IDEVICE_ACTIVATION_API void idevice_activation_response_get_title(idevice_activation_response_t response, const char** title);
 IDEVICE_ACTIVATION_API void idevice_activation_response_get_description(idevice_activation_response_t response, const char** description);
 IDEVICE_ACTIVATION_API void idevice_activation_response_get_activation_record(idevice_activation_response_t response, plist_t* activation_record);
+/* Moves the activation record out of the response, the caller has to free it. */
+IDEVICE_ACTIVATION_API void idevice_activation_response_take_activation_record(idevice_activation_response_t response, plist_t* activation_record);
+/* The returned activation record is owned by the response and must not be
+ * modified or freed. */
+IDEVICE_ACTIVATION_API plist_t idevice_activation_response_borrow_activation_record(idevice_activation_response_t response);
 IDEVICE_ACTIVATION_API void idevice_activation_response_get_headers(idevice_activation_response_t response, plist_t* headers);
+/* The returned value is owned by the response, NULL if the header is missing. */
+IDEVICE_ACTIVATION_API void idevice_activation_response_get_header(idevice_activation_response_t response, const char* name, const char** value);
+/* Typed access to the Content-Length header of the final response, 0 if
+ * it is missing, and to the last Location header, which is the target of
+ * the last redirect that was followed. The length is the size before any
+ * content decoding. The location is owned by the response, NULL if no
+ * Location header was received. */
+IDEVICE_ACTIVATION_API void idevice_activation_response_get_content_length(idevice_activation_response_t response, uint64_t* length);
+IDEVICE_ACTIVATION_API void idevice_activation_response_get_location(idevice_activation_response_t response, const char** location);
+IDEVICE_ACTIVATION_API void idevice_activation_response_get_timings(idevice_activation_response_t response, idevice_activation_timings_t* timings);
 
 IDEVICE_ACTIVATION_API int idevice_activation_response_is_activation_acknowledged(idevice_activation_response_t response);
 IDEVICE_ACTIVATION_API int idevice_activation_response_is_authentication_required(idevice_activation_response_t response);
@@ -104,6 +212,20 @@ IDEVICE_ACTIVATION_API int idevice_activation_response_has_errors(idevice_activa
 
 IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_send_request(idevice_activation_request_t request, idevice_activation_response_t* response);
 
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_session_new(idevice_activation_session_t* session);
+IDEVICE_ACTIVATION_API void idevice_activation_session_free(idevice_activation_session_t session);
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_session_send_request(idevice_activation_session_t session, idevice_activation_request_t request, idevice_activation_response_t* response);
+
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_multi_new(idevice_activation_multi_t* multi);
+IDEVICE_ACTIVATION_API void idevice_activation_multi_free(idevice_activation_multi_t multi);
+/* max_streams limits the concurrent streams per connection, 0 keeps the
+ * libcurl default. A limit needs libcurl 7.67.0 or newer, older versions
+ * return IDEVICE_ACTIVATION_E_NOT_SUPPORTED and leave HTTP/2 disabled. */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_multi_set_http2(idevice_activation_multi_t multi, int enable, int max_streams);
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_send_request_async(idevice_activation_multi_t multi, idevice_activation_request_t request, idevice_activation_request_cb_t callback, void* userdata);
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_multi_perform(idevice_activation_multi_t multi, int* running);
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_multi_poll(idevice_activation_multi_t multi, int timeout_ms, int* running);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,8 +27,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include <libxml/parser.h>
 #include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
 #include <libxml/HTMLtree.h>
 #include <curl/curl.h>
 
@@ -47,6 +50,9 @@
 #ifdef _WIN32
 #include <windows.h>
 #define strncasecmp _strnicmp
+#define strcasecmp _stricmp
+#else
+#include <pthread.h>
 #endif
 
 #include <libideviceactivation.h>
@@ -89,42 +95,287 @@ typedef enum {
 	IDEVICE_ACTIVATION_CONTENT_TYPE_HTML,
 	IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML,
 	IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST,
+	IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST_BINARY,
 	IDEVICE_ACTIVATION_CONTENT_TYPE_UNKNOWN
 } idevice_activation_content_type_t;
 
+/* A multipart field as it goes on the wire. The value either points
+ * into the string node of the request fields or into buffer, which
+ * holds the serialized plist of a non-string field. Borrowed parts
+ * belong to the body of a request template. */
+struct idevice_activation_body_part {
+	char* name;
+	char* buffer;
+	const char* data;
+	size_t size;
+	int borrowed;
+};
+
+/* Request body serialized by idevice_activation_request_serialize(),
+ * kept until the fields or the body format change. */
+struct idevice_activation_body {
+	int valid;
+	idevice_activation_content_type_t content_type;
+	char* data;
+	size_t size;
+	struct idevice_activation_body_part* parts;
+	unsigned int num_parts;
+};
+
 struct idevice_activation_request_private {
 	idevice_activation_client_type_t client_type;
 	idevice_activation_content_type_t content_type;
 	char* url;
 	plist_t fields;
+	long connect_timeout_ms;
+	long timeout_ms;
+	long low_speed_limit;
+	long low_speed_time;
+	idevice_activation_cancel_t cancel;
+	idevice_activation_retry_policy_t retry_policy;
+	int compression;
+	int streaming_parse;
+	int lazy_parse;
+	idevice_activation_plist_format_t plist_format;
+	struct idevice_activation_body body;
+	// template the request was forked from, fields then only holds
+	// the fields set on the request itself
+	idevice_activation_request_template_t shared;
+};
+
+struct idevice_activation_cancel_private {
+	// set from any thread, only accessed through the atomic macros
+	long cancelled;
+};
+
+struct idevice_activation_arena_block {
+	struct idevice_activation_arena_block* next;
+	size_t capacity;
+	size_t used;
+};
+
+struct idevice_activation_arena {
+	struct idevice_activation_arena_block* blocks;
+};
+
+struct idevice_activation_header {
+	const char* name;
+	const char* value;
+	struct idevice_activation_header* next;
 };
 
 struct idevice_activation_response_private {
 	char* raw_content;
 	size_t raw_content_size;
+	size_t raw_content_capacity;
 	idevice_activation_content_type_t content_type;
 	char* title;
 	char* description;
 	plist_t activation_record;
+	struct idevice_activation_header* header_list;
+	struct idevice_activation_header** headers_tail;
+	unsigned long long content_length;
+	const char* retry_after;
+	const char* location;
 	plist_t headers;
 	plist_t fields;
 	plist_t fields_require_input;
 	plist_t fields_secure_input;
 	plist_t labels;
 	plist_t labels_placeholder;
+	long http_status;
+	idevice_activation_timings_t timings;
+	int streaming_parse;
+	int parse_pending;
+	idevice_activation_error_t parse_result;
+	xmlParserCtxtPtr push_parser;
+	xmlDocPtr doc;
 	int is_activation_ack;
 	int is_auth_required;
 	int has_errors;
+	struct idevice_activation_arena arena;
+};
+
+struct idevice_activation_session_private {
+	CURL* handle;
+};
+
+#if LIBCURL_VERSION_NUM >= 0x073800
+#define IDEVICE_ACTIVATION_USE_MIME 1
+#endif
+
+struct idevice_activation_transfer {
+	CURL* handle;
+#ifdef IDEVICE_ACTIVATION_USE_MIME
+	curl_mime* mime;
+#else
+	struct curl_httppost* form;
+#endif
+	struct curl_slist* slist;
+	idevice_activation_response_t response;
+	idevice_activation_request_t request;
+	idevice_activation_request_cb_t callback;
+	void* userdata;
+	unsigned int attempt;
+	int waiting;
+	uint64_t retry_at;
+	struct idevice_activation_transfer* next;
+};
+
+struct idevice_activation_multi_private {
+	CURLM* handle;
+	struct idevice_activation_transfer* transfers;
+	int http2;
+};
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION idevice_activation_mutex_t;
+#define idevice_activation_mutex_init(m) InitializeCriticalSection(m)
+#define idevice_activation_mutex_destroy(m) DeleteCriticalSection(m)
+#define idevice_activation_mutex_lock(m) EnterCriticalSection(m)
+#define idevice_activation_mutex_unlock(m) LeaveCriticalSection(m)
+#define idevice_activation_atomic_load(p) InterlockedCompareExchange((p), 0, 0)
+#define idevice_activation_atomic_store(p, v) InterlockedExchange((p), (v))
+#else
+typedef pthread_mutex_t idevice_activation_mutex_t;
+#define idevice_activation_mutex_init(m) pthread_mutex_init(m, NULL)
+#define idevice_activation_mutex_destroy(m) pthread_mutex_destroy(m)
+#define idevice_activation_mutex_lock(m) pthread_mutex_lock(m)
+#define idevice_activation_mutex_unlock(m) pthread_mutex_unlock(m)
+#define idevice_activation_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define idevice_activation_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+struct idevice_activation_request_template_private {
+	struct idevice_activation_request_private request;
+	unsigned int refcount;
+	idevice_activation_mutex_t lock;
+};
+
+/* DNS and TLS session cache shared by all handles of the library */
+static CURLSH* shared_cache = NULL;
+static idevice_activation_mutex_t shared_cache_locks[CURL_LOCK_DATA_LAST];
+
+static void idevice_activation_shared_cache_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+	idevice_activation_mutex_lock(&shared_cache_locks[data]);
+}
+
+static void idevice_activation_shared_cache_unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+	idevice_activation_mutex_unlock(&shared_cache_locks[data]);
+}
+
+static void idevice_activation_shared_cache_init(void)
+{
+	int i;
+
+	shared_cache = curl_share_init();
+	if (!shared_cache)
+		return;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		idevice_activation_mutex_init(&shared_cache_locks[i]);
+	}
+	curl_share_setopt(shared_cache, CURLSHOPT_LOCKFUNC, idevice_activation_shared_cache_lock);
+	curl_share_setopt(shared_cache, CURLSHOPT_UNLOCKFUNC, idevice_activation_shared_cache_unlock);
+	curl_share_setopt(shared_cache, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(shared_cache, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	// CURL_LOCK_DATA_CONNECT is left out on purpose: libcurl does not
+	// support sharing connections between concurrently running threads.
+	// Sessions and multi handles keep their own connection cache instead.
+}
+
+static void idevice_activation_shared_cache_deinit(void)
+{
+	int i;
+
+	if (!shared_cache)
+		return;
+
+	// handles still attached to the share keep using the locks
+	if (curl_share_cleanup(shared_cache) != CURLSHE_OK)
+		return;
+
+	shared_cache = NULL;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		idevice_activation_mutex_destroy(&shared_cache_locks[i]);
+	}
+}
+
+/* XPath expressions used by the response parsers, compiled on first use */
+enum idevice_activation_xpath {
+	XPATH_ERROR_TITLE,
+	XPATH_ACK_RECEIVED,
+	XPATH_ALERT_TITLE,
+	XPATH_PAGE_TITLE,
+	XPATH_FOOTER,
+	XPATH_TEXT_ROWS,
+	XPATH_SERVER_INFO,
+	XPATH_HTML_AUTH_REQUIRED,
+	XPATH_HTML_PLIST,
+	XPATH_LAST
+};
+
+static const char* xpath_expressions[XPATH_LAST] = {
+	"/xmlui/navigationBar/@title",
+	"/xmlui/clientInfo[@ack-received='true']",
+	"/xmlui/alert/@title",
+	"/xmlui/page/navigationBar/@title",
+	"/xmlui/page/tableView/section/footer[not (@url)]",
+	"/xmlui/page//editableTextRow",
+	"/xmlui/serverInfo/@*",
+	"//input[@name='isAuthRequired' and @value='true']",
+	"//script[@type='text/x-apple-plist']/plist"
 };
 
+static xmlXPathCompExprPtr xpath_compiled[XPATH_LAST];
+static idevice_activation_mutex_t xpath_compiled_lock;
+
+static xmlXPathObjectPtr idevice_activation_xpath_eval(enum idevice_activation_xpath expr, xmlXPathContextPtr context)
+{
+	xmlXPathCompExprPtr comp = NULL;
+
+	idevice_activation_mutex_lock(&xpath_compiled_lock);
+	if (!xpath_compiled[expr]) {
+		xpath_compiled[expr] = xmlXPathCompile((const xmlChar*) xpath_expressions[expr]);
+	}
+	comp = xpath_compiled[expr];
+	idevice_activation_mutex_unlock(&xpath_compiled_lock);
+
+	if (!comp)
+		return NULL;
+
+	// a compiled expression is never modified by evaluation and can be
+	// shared between threads as long as each one uses its own context
+	return xmlXPathCompiledEval(comp, context);
+}
+
+static void idevice_activation_xpath_cache_deinit(void)
+{
+	int i;
+
+	for (i = 0; i < XPATH_LAST; i++) {
+		if (xpath_compiled[i]) {
+			xmlXPathFreeCompExpr(xpath_compiled[i]);
+			xpath_compiled[i] = NULL;
+		}
+	}
+	idevice_activation_mutex_destroy(&xpath_compiled_lock);
+}
+
 static void internal_libideviceactivation_deinit(void)
 {
+	idevice_activation_xpath_cache_deinit();
+	idevice_activation_shared_cache_deinit();
 	curl_global_cleanup();
 }
 
 INITIALIZER(internal_libideviceactivation_init)
 {
 	curl_global_init(CURL_GLOBAL_ALL);
+	idevice_activation_shared_cache_init();
+	idevice_activation_mutex_init(&xpath_compiled_lock);
 	atexit(internal_libideviceactivation_deinit);
 }
 
@@ -134,6 +385,105 @@ void idevice_activation_set_debug_level(int level) {
 	debug_level = level;
 }
 
+static uint64_t idevice_activation_get_time_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static uint64_t idevice_activation_get_time_ms(void)
+{
+	return idevice_activation_get_time_us() / 1000;
+}
+
+/* Strings produced while receiving and parsing a response are carved out
+ * of a few larger blocks owned by the response and released all at once. */
+#define IDEVICE_ACTIVATION_ARENA_BLOCK_SIZE 2048
+#define IDEVICE_ACTIVATION_ARENA_ALIGN 8
+
+static void* idevice_activation_arena_alloc(struct idevice_activation_arena* arena, size_t size)
+{
+	struct idevice_activation_arena_block* block = arena->blocks;
+	size_t capacity = IDEVICE_ACTIVATION_ARENA_BLOCK_SIZE;
+
+	if (block) {
+		size_t offset = (block->used + IDEVICE_ACTIVATION_ARENA_ALIGN - 1) & ~((size_t)IDEVICE_ACTIVATION_ARENA_ALIGN - 1);
+		if (offset <= block->capacity && size <= block->capacity - offset) {
+			block->used = offset + size;
+			return (char*)(block + 1) + offset;
+		}
+	}
+
+	if (size > capacity) {
+		if (size > ((size_t)-1) - sizeof(struct idevice_activation_arena_block))
+			return NULL;
+		capacity = size;
+	}
+
+	block = (struct idevice_activation_arena_block*) malloc(sizeof(struct idevice_activation_arena_block) + capacity);
+	if (!block)
+		return NULL;
+
+	block->capacity = capacity;
+	block->used = size;
+	if (capacity > IDEVICE_ACTIVATION_ARENA_BLOCK_SIZE && arena->blocks) {
+		// oversized allocations get a block of their own, keep using
+		// the remaining room of the current one
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+	} else {
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	return block + 1;
+}
+
+static char* idevice_activation_arena_strndup(struct idevice_activation_arena* arena, const char* str, size_t len)
+{
+	char* copy = (char*) idevice_activation_arena_alloc(arena, len + 1);
+	if (copy) {
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+	}
+
+	return copy;
+}
+
+static char* idevice_activation_arena_strdup(struct idevice_activation_arena* arena, const char* str)
+{
+	return idevice_activation_arena_strndup(arena, str, strlen(str));
+}
+
+static void idevice_activation_arena_free(struct idevice_activation_arena* arena)
+{
+	struct idevice_activation_arena_block* block = arena->blocks;
+
+	while (block) {
+		struct idevice_activation_arena_block* next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->blocks = NULL;
+}
+
+#define BPLIST_MAGIC "bplist00"
+#define BPLIST_MAGIC_SIZE 8
+
+static int idevice_activation_is_binary_plist(const char* content, size_t size)
+{
+	return (content && size >= BPLIST_MAGIC_SIZE && memcmp(content, BPLIST_MAGIC, BPLIST_MAGIC_SIZE) == 0);
+}
+
 static idevice_activation_error_t idevice_activation_activation_record_from_plist(idevice_activation_response_t response, plist_t plist)
 {
 	plist_t record = plist_dict_get_item(plist, "ActivationRecord");
@@ -146,7 +496,19 @@ static idevice_activation_error_t idevice_activation_activation_record_from_plis
 				response->is_activation_ack = 1;
 			}
 		}
-		response->activation_record = plist_new_data(response->raw_content, response->raw_content_size);
+		if (idevice_activation_is_binary_plist(response->raw_content, response->raw_content_size)) {
+			// the record is passed on as XML, whatever format the server used
+			char* xml = NULL;
+			uint32_t xml_size = 0;
+			plist_to_xml(plist, &xml, &xml_size);
+			if (!xml) {
+				return IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
+			}
+			response->activation_record = plist_new_data(xml, xml_size);
+			free(xml);
+		} else {
+			response->activation_record = plist_new_data(response->raw_content, response->raw_content_size);
+		}
 	} else {
 		plist_t activation_node = plist_dict_get_item(plist, "iphone-activation");
 		if (!activation_node) {
@@ -171,6 +533,76 @@ static idevice_activation_error_t idevice_activation_activation_record_from_plis
 	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
 
+static int idevice_activation_xml_parse_options(idevice_activation_content_type_t content_type)
+{
+	switch (content_type) {
+		case IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML:
+			return XML_PARSE_NOERROR;
+		case IDEVICE_ACTIVATION_CONTENT_TYPE_HTML:
+			return XML_PARSE_RECOVER | XML_PARSE_NOERROR;
+		default:
+			return -1;
+	}
+}
+
+static void idevice_activation_response_stream_chunk(idevice_activation_response_t response, const char* data, size_t size)
+{
+	if (!response->push_parser) {
+		// only start with the first chunk and once we know what to expect
+		if (response->raw_content_size != size)
+			return;
+
+		int options = idevice_activation_xml_parse_options(response->content_type);
+		if (options < 0)
+			return;
+
+		// hand over just enough bytes to detect the encoding before the
+		// parser options are applied
+		int head = (size > 4) ? 4 : (int)size;
+		response->push_parser = xmlCreatePushParserCtxt(NULL, NULL, data, head, "ideviceactivation.xml");
+		if (!response->push_parser)
+			return;
+		xmlCtxtUseOptions(response->push_parser, options);
+		data += head;
+		size -= head;
+	}
+
+	if (size > 0) {
+		xmlParseChunk(response->push_parser, data, (int)size, 0);
+	}
+}
+
+static void idevice_activation_response_finish_stream(idevice_activation_response_t response)
+{
+	xmlParserCtxtPtr ctxt = response->push_parser;
+
+	if (!ctxt)
+		return;
+
+	response->push_parser = NULL;
+	xmlParseChunk(ctxt, NULL, 0, 1);
+	if (ctxt->wellFormed || ctxt->recovery) {
+		response->doc = ctxt->myDoc;
+	} else {
+		xmlFreeDoc(ctxt->myDoc);
+	}
+	ctxt->myDoc = NULL;
+	xmlFreeParserCtxt(ctxt);
+}
+
+static xmlDocPtr idevice_activation_response_get_doc(idevice_activation_response_t response)
+{
+	xmlDocPtr doc = response->doc;
+
+	// use the document built while receiving if there is one
+	if (doc) {
+		response->doc = NULL;
+		return doc;
+	}
+
+	return xmlReadMemory(response->raw_content, response->raw_content_size, "ideviceactivation.xml", NULL, idevice_activation_xml_parse_options(response->content_type));
+}
+
 static void idevice_activation_response_add_field(idevice_activation_response_t response, const char* key, const char* value, int required_input, int secure_input)
 {
 	plist_dict_set_item(response->fields, key, plist_new_string(value));
@@ -182,22 +614,65 @@ static void idevice_activation_response_add_field(idevice_activation_response_t
 	}
 }
 
-static idevice_activation_error_t idevice_activation_parse_buddyml_response(idevice_activation_response_t response)
+static idevice_activation_error_t idevice_activation_response_set_description(idevice_activation_response_t response, xmlDocPtr doc, xmlNodePtr* nodes, int count)
 {
 	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
-	xmlDocPtr doc = NULL;
-	xmlXPathContextPtr context = NULL;
-	xmlXPathObjectPtr xpath_result = NULL;
+	xmlChar** contents = NULL;
+	size_t len = 0;
+	int found = 0;
 	int i = 0;
 
-	if (response->content_type != IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML)
-		return IDEVICE_ACTIVATION_E_UNKNOWN_CONTENT_TYPE;
+	if (count <= 0)
+		return IDEVICE_ACTIVATION_E_SUCCESS;
 
-	doc = xmlReadMemory(response->raw_content, response->raw_content_size, "ideviceactivation.xml", NULL, XML_PARSE_NOERROR);
-	if (!doc) {
-		result = IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
-		goto cleanup;
+	contents = (xmlChar**) calloc(count, sizeof(xmlChar*));
+	if (!contents)
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+
+	// measure first, then join the footers with '\n' in a single allocation
+	for (i = 0; i < count; i++) {
+		contents[i] = xmlNodeListGetString(doc, nodes[i]->xmlChildrenNode, 1);
+		if (contents[i]) {
+			len += xmlStrlen(contents[i]) + 1;
+			found++;
+		}
+	}
+
+	if (found > 0) {
+		char* description = (char*) idevice_activation_arena_alloc(&response->arena, len);
+		if (!description) {
+			result = IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+		} else {
+			char* p = description;
+			for (i = 0; i < count; i++) {
+				if (contents[i]) {
+					const size_t content_len = xmlStrlen(contents[i]);
+					memcpy(p, contents[i], content_len);
+					p += content_len;
+					*p++ = '\n';
+				}
+			}
+			// replace the last '\n'
+			description[len - 1] = '\0';
+			response->description = description;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (contents[i])
+			xmlFree(contents[i]);
 	}
+	free(contents);
+
+	return result;
+}
+
+static idevice_activation_error_t idevice_activation_parse_buddyml_xpath(idevice_activation_response_t response, xmlDocPtr doc)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	xmlXPathContextPtr context = NULL;
+	xmlXPathObjectPtr xpath_result = NULL;
+	int i = 0;
 
 	context = xmlXPathNewContext(doc);
 	if (!context) {
@@ -207,7 +682,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 
 	// check for an error
 	// <navigationBar> appears directly under <xmlui> only in case of an error
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/navigationBar/@title", context);
+	xpath_result = idevice_activation_xpath_eval(XPATH_ERROR_TITLE, context);
 	if (!xpath_result) {
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
@@ -216,7 +691,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 	if (xpath_result->nodesetval && xpath_result->nodesetval->nodeNr) {
 		xmlChar* content =  xmlNodeListGetString(doc, xpath_result->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
 		if (content) {
-			response->title = strdup((const char*) content);
+			response->title = idevice_activation_arena_strdup(&response->arena, (const char*) content);
 			xmlFree(content);
 		}
 
@@ -229,7 +704,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 		xmlXPathFreeObject(xpath_result);
 		xpath_result = NULL;
 	}
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/clientInfo[@ack-received='true']", context);
+	xpath_result = idevice_activation_xpath_eval(XPATH_ACK_RECEIVED, context);
 	if (!xpath_result) {
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
@@ -246,7 +721,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 		xmlXPathFreeObject(xpath_result);
 		xpath_result = NULL;
 	}
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/alert/@title", context);
+	xpath_result = idevice_activation_xpath_eval(XPATH_ALERT_TITLE, context);
 	if (!xpath_result) {
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
@@ -257,7 +732,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 		// <alert> exists only in case of incorrect credentials
 		xmlChar* content =  xmlNodeListGetString(doc, xpath_result->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
 		if (content) {
-			response->title = strdup((const char*) content);
+			response->title = idevice_activation_arena_strdup(&response->arena, (const char*) content);
 			xmlFree(content);
 		}
 	} else {
@@ -265,19 +740,19 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 			xmlXPathFreeObject(xpath_result);
 			xpath_result = NULL;
 		}
-		xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/page/navigationBar/@title", context);
+		xpath_result = idevice_activation_xpath_eval(XPATH_PAGE_TITLE, context);
 		if (!xpath_result) {
 			result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 			goto cleanup;
 		}
 
-		if (!xpath_result->nodesetval) {
+		if (!xpath_result->nodesetval || !xpath_result->nodesetval->nodeNr) {
 			result =  IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
 			goto cleanup;
 		}
 		xmlChar* content =  xmlNodeListGetString(doc, xpath_result->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
 		if (content) {
-			response->title = strdup((const char*) content);
+			response->title = idevice_activation_arena_strdup(&response->arena, (const char*) content);
 			xmlFree(content);
 		}
 	}
@@ -287,38 +762,20 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 		xmlXPathFreeObject(xpath_result);
 		xpath_result = NULL;
 	}
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/page/tableView/section/footer[not (@url)]", context);
+	xpath_result = idevice_activation_xpath_eval(XPATH_FOOTER, context);
 	if (!xpath_result) {
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
 	}
 	if (!xpath_result->nodesetval) {
-		xmlXPathFreeObject(xpath_result);
-		xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/page/tableView/section[@footer and not(@footerLinkURL)]/@footer", context);
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
 	}
 
 	if (xpath_result->nodesetval) {
-		char* response_description = (char*) malloc(sizeof(char));
-		response_description[0] = '\0';
-
-		for(i = 0; i < xpath_result->nodesetval->nodeNr; i++) {
-			xmlChar* content = xmlNodeListGetString(doc, xpath_result->nodesetval->nodeTab[i]->xmlChildrenNode, 1);
-			if (content) {
-				const size_t len = strlen(response_description);
-				response_description = (char*) realloc(response_description, len + xmlStrlen(content) + 2);
-				sprintf(&response_description[len], "%s\n", (const char*) content);
-				xmlFree(content);
-			}
-		}
-
-		if (strlen(response_description) > 0) {
-			// remove the last '\n'
-			response_description[strlen(response_description) - 1] = '\0';
-			response->description = response_description;
-		} else {
-			free(response_description);
+		result = idevice_activation_response_set_description(response, doc, xpath_result->nodesetval->nodeTab, xpath_result->nodesetval->nodeNr);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+			goto cleanup;
 		}
 	}
 
@@ -328,7 +785,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 		xpath_result = NULL;
 	}
 
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/page//editableTextRow", context);
+	xpath_result = idevice_activation_xpath_eval(XPATH_TEXT_ROWS, context);
 	if (!xpath_result) {
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
@@ -373,7 +830,7 @@ static idevice_activation_error_t idevice_activation_parse_buddyml_response(idev
 		xpath_result = NULL;
 	}
 
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "/xmlui/serverInfo/@*", context);
+	xpath_result = idevice_activation_xpath_eval(XPATH_SERVER_INFO, context);
 	if (!xpath_result) {
 		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 		goto cleanup;
@@ -403,934 +860,3512 @@ cleanup:
 		xmlXPathFreeObject(xpath_result);
 	if (context)
 		xmlXPathFreeContext(context);
-	if (doc)
-		xmlFreeDoc(doc);
 
 	return result;
 }
 
-static idevice_activation_error_t idevice_activation_parse_html_response(idevice_activation_response_t response)
-{
-	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
-	xmlDocPtr doc = NULL;
-	xmlXPathContextPtr context = NULL;
-	xmlXPathObjectPtr xpath_result = NULL;
+struct idevice_activation_buddyml_nodes {
+	xmlNodePtr* items;
+	int count;
+	int capacity;
+};
 
-	if (response->content_type != IDEVICE_ACTIVATION_CONTENT_TYPE_HTML)
-		return IDEVICE_ACTIVATION_E_UNKNOWN_CONTENT_TYPE;
+struct idevice_activation_buddyml_info {
+	xmlAttrPtr error_title;
+	int is_activation_ack;
+	xmlAttrPtr alert_title;
+	xmlAttrPtr page_title;
+	struct idevice_activation_buddyml_nodes footers;
+	struct idevice_activation_buddyml_nodes text_rows;
+	struct idevice_activation_buddyml_nodes server_info;
+	int has_row_without_id;
+};
 
-	doc = xmlReadMemory(response->raw_content, response->raw_content_size, "ideviceactivation.xml", NULL, XML_PARSE_RECOVER | XML_PARSE_NOERROR);
-	if (!doc) {
-		result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
-		goto cleanup;
+static int idevice_activation_buddyml_nodes_add(struct idevice_activation_buddyml_nodes* nodes, xmlNodePtr node)
+{
+	if (nodes->count == nodes->capacity) {
+		int new_capacity = (nodes->capacity > 0) ? nodes->capacity * 2 : 8;
+		xmlNodePtr* new_items = (xmlNodePtr*) realloc(nodes->items, new_capacity * sizeof(xmlNodePtr));
+		if (!new_items)
+			return -1;
+		nodes->items = new_items;
+		nodes->capacity = new_capacity;
 	}
+	nodes->items[nodes->count++] = node;
 
-	context = xmlXPathNewContext(doc);
-	if (!context) {
-		result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
-		goto cleanup;
-	}
+	return 0;
+}
 
-	// check for authentication required
-	if (xpath_result) {
-		xmlXPathFreeObject(xpath_result);
-		xpath_result = NULL;
-	}
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "//input[@name='isAuthRequired' and @value='true']", context);
-	if (!xpath_result) {
-		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
-		goto cleanup;
-	}
+static int idevice_activation_buddyml_is(xmlNodePtr node, const char* name)
+{
+	// XPath name tests without a prefix only match elements without namespace
+	return (node->type == XML_ELEMENT_NODE && !node->ns && !xmlStrcmp(node->name, (const xmlChar*) name));
+}
 
-	if (xpath_result->nodesetval && xpath_result->nodesetval->nodeNr) {
-		response->is_auth_required = 1;
-		goto cleanup;
-	}
+static xmlAttrPtr idevice_activation_buddyml_attr(xmlNodePtr node, const char* name)
+{
+	xmlAttrPtr attr = NULL;
 
-	// check for plist content
-	xpath_result = xmlXPathEvalExpression((const xmlChar*) "//script[@type='text/x-apple-plist']/plist", context);
-	if (!xpath_result) {
-		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
-		goto cleanup;
+	for (attr = node->properties; attr; attr = attr->next) {
+		if (!attr->ns && !xmlStrcmp(attr->name, (const xmlChar*) name)) {
+			return attr;
+		}
 	}
 
-	if (xpath_result->nodesetval && xpath_result->nodesetval->nodeNr) {
-		plist_t plist = NULL;
-		xmlBufferPtr plistNodeBuffer = xmlBufferCreate();
-		if (htmlNodeDump(plistNodeBuffer, doc, xpath_result->nodesetval->nodeTab[0]) == -1) {
-			result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
-			goto local_cleanup;
+	return NULL;
+}
+
+static idevice_activation_error_t idevice_activation_buddyml_walk_page(struct idevice_activation_buddyml_info* info, xmlNodePtr parent, int depth)
+{
+	xmlNodePtr node = NULL;
+
+	for (node = parent->children; node; node = node->next) {
+		if (node->type != XML_ELEMENT_NODE)
+			continue;
+
+		// /xmlui/page//editableTextRow
+		if (idevice_activation_buddyml_is(node, "editableTextRow")) {
+			if (!idevice_activation_buddyml_attr(node, "id")) {
+				// only fatal if the fields are needed, see below
+				info->has_row_without_id = 1;
+			} else if (idevice_activation_buddyml_nodes_add(&info->text_rows, node) < 0) {
+				return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+			}
 		}
 
-		plist_from_xml((const char*) plistNodeBuffer->content, plistNodeBuffer->use, &plist);
-		if (!plist) {
-			result = IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
-			goto local_cleanup;
+		// /xmlui/page/navigationBar/@title
+		if (depth == 0 && !info->page_title && idevice_activation_buddyml_is(node, "navigationBar")) {
+			info->page_title = idevice_activation_buddyml_attr(node, "title");
 		}
-		result = idevice_activation_activation_record_from_plist(response, plist);
-		plist_free(plist);
 
-	local_cleanup:
-		if (plistNodeBuffer)
-			xmlBufferFree(plistNodeBuffer);
-		goto cleanup;
+		// /xmlui/page/tableView/section/footer[not (@url)]
+		if (depth == 2 && idevice_activation_buddyml_is(node, "footer")
+		    && idevice_activation_buddyml_is(parent, "section")
+		    && idevice_activation_buddyml_is(parent->parent, "tableView")
+		    && !idevice_activation_buddyml_attr(node, "url")) {
+			if (idevice_activation_buddyml_nodes_add(&info->footers, node) < 0)
+				return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+		}
+
+		idevice_activation_error_t result = idevice_activation_buddyml_walk_page(info, node, depth + 1);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+			return result;
 	}
 
-	response->has_errors = 1;
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
 
-cleanup:
-	if (xpath_result)
-		xmlXPathFreeObject(xpath_result);
-	if (context)
-		xmlXPathFreeContext(context);
-	if (doc)
-		xmlFreeDoc(doc);
+static idevice_activation_error_t idevice_activation_buddyml_walk(struct idevice_activation_buddyml_info* info, xmlDocPtr doc)
+{
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	xmlNodePtr node = NULL;
+
+	if (!root || !idevice_activation_buddyml_is(root, "xmlui"))
+		return IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
+
+	for (node = root->children; node; node = node->next) {
+		if (idevice_activation_buddyml_is(node, "navigationBar")) {
+			// <navigationBar> appears directly under <xmlui> only in case of an error
+			if (!info->error_title)
+				info->error_title = idevice_activation_buddyml_attr(node, "title");
+		} else if (idevice_activation_buddyml_is(node, "clientInfo")) {
+			xmlAttrPtr ack = idevice_activation_buddyml_attr(node, "ack-received");
+			if (ack && ack->children && ack->children->type == XML_TEXT_NODE && !ack->children->next
+			    && !xmlStrcmp(ack->children->content, (const xmlChar*) "true")) {
+				info->is_activation_ack = 1;
+			}
+		} else if (idevice_activation_buddyml_is(node, "alert")) {
+			if (!info->alert_title)
+				info->alert_title = idevice_activation_buddyml_attr(node, "title");
+		} else if (idevice_activation_buddyml_is(node, "page")) {
+			idevice_activation_error_t result = idevice_activation_buddyml_walk_page(info, node, 0);
+			if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+				return result;
+		} else if (idevice_activation_buddyml_is(node, "serverInfo")) {
+			if (idevice_activation_buddyml_nodes_add(&info->server_info, node) < 0)
+				return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+		}
+	}
 
-	return result;
+	if (!info->error_title && !info->is_activation_ack && !info->alert_title && !info->page_title)
+		return IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
 
-static idevice_activation_error_t idevice_activation_parse_raw_response(idevice_activation_response_t response)
+static char* idevice_activation_buddyml_attr_value(idevice_activation_response_t response, xmlDocPtr doc, xmlAttrPtr attr)
 {
+	char* value = NULL;
+	xmlChar* content = xmlNodeListGetString(doc, attr->children, 1);
+
+	if (content) {
+		value = idevice_activation_arena_strdup(&response->arena, (const char*) content);
+		xmlFree(content);
+	}
+
+	return value;
+}
+
+static idevice_activation_error_t idevice_activation_parse_buddyml_single_pass(idevice_activation_response_t response, xmlDocPtr doc)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	struct idevice_activation_buddyml_info info;
+	int i = 0;
+
+	memset(&info, '\0', sizeof(info));
+
+	// gather everything in one walk over the tree, nothing in the response
+	// is touched until the document turned out to be usable
+	result = idevice_activation_buddyml_walk(&info, doc);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		goto cleanup;
+	}
+
+	if (info.error_title) {
+		response->title = idevice_activation_buddyml_attr_value(response, doc, info.error_title);
+		response->has_errors = 1;
+		goto cleanup;
+	}
+
+	if (info.is_activation_ack) {
+		response->is_activation_ack = 1;
+		goto cleanup;
+	}
+
+	// the XPath based parser rejects an input field without id
+	if (info.has_row_without_id) {
+		result = IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
+		goto cleanup;
+	}
+
+	// <alert> exists only in case of incorrect credentials
+	response->title = idevice_activation_buddyml_attr_value(response, doc, (info.alert_title) ? info.alert_title : info.page_title);
+
+	result = idevice_activation_response_set_description(response, doc, info.footers.items, info.footers.count);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		goto cleanup;
+	}
+
+	for (i = 0; i < info.text_rows.count; i++) {
+		xmlNodePtr row = info.text_rows.items[i];
+		xmlChar* id = xmlGetProp(row, (const xmlChar*) "id");
+		if (!id)
+			continue;
+
+		int secure_input = 0;
+		xmlChar* secure = xmlGetProp(row, (const xmlChar*) "secure");
+		if (secure) {
+			if (!strcmp((const char*)secure, "true")) {
+				secure_input = 1;
+			}
+			xmlFree(secure);
+		}
+
+		idevice_activation_response_add_field(response, (const char*) id, "", 1, secure_input);
+
+		xmlChar* label = xmlGetProp(row, (const xmlChar*) "label");
+		if (label) {
+			plist_dict_set_item(response->labels, (const char*)id, plist_new_string((const char*) label));
+			xmlFree(label);
+		}
+		xmlChar* placeholder = xmlGetProp(row, (const xmlChar*) "placeholder");
+		if (placeholder) {
+			plist_dict_set_item(response->labels_placeholder, (const char*)id, plist_new_string((const char*) placeholder));
+			xmlFree(placeholder);
+		}
+
+		xmlFree(id);
+	}
+
+	for (i = 0; i < info.server_info.count; i++) {
+		xmlAttrPtr attr = NULL;
+		for (attr = info.server_info.items[i]->properties; attr; attr = attr->next) {
+			xmlChar* content = xmlNodeGetContent((xmlNodePtr) attr);
+			if (content) {
+				if (!xmlStrcmp(attr->name, (const xmlChar*) "isAuthRequired")) {
+					response->is_auth_required = 1;
+				}
+
+				idevice_activation_response_add_field(response, (const char*) attr->name, (const char*) content, 0, 0);
+				xmlFree(content);
+			}
+		}
+	}
+
+	if (plist_dict_get_size(response->fields) == 0) {
+		response->has_errors = 1;
+	}
+
+cleanup:
+	free(info.footers.items);
+	free(info.text_rows.items);
+	free(info.server_info.items);
+
+	return result;
+}
+
+static idevice_activation_error_t idevice_activation_parse_buddyml_response(idevice_activation_response_t response)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	xmlDocPtr doc = NULL;
+
+	if (response->content_type != IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML)
+		return IDEVICE_ACTIVATION_E_UNKNOWN_CONTENT_TYPE;
+
+	doc = idevice_activation_response_get_doc(response);
+	if (!doc) {
+		return IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
+	}
+
+	result = idevice_activation_parse_buddyml_single_pass(response, doc);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		// leave the odd cases to the XPath based parser
+		if (debug_level > 0)
+			fprintf(stderr, "%s: falling back to XPath parser (error %d)\n", __func__, result);
+		result = idevice_activation_parse_buddyml_xpath(response, doc);
+	}
+
+	xmlFreeDoc(doc);
+
+	return result;
+}
+
+#define PLIST_NODE_MAX_DEPTH 256
+
+static int idevice_activation_plist_node_is(xmlNodePtr node, const char* name)
+{
+	return (node && node->type == XML_ELEMENT_NODE && !xmlStrcmp(node->name, (const xmlChar*) name));
+}
+
+static xmlNodePtr idevice_activation_plist_node_next(xmlNodePtr node)
+{
+	while (node && node->type != XML_ELEMENT_NODE)
+		node = node->next;
+
+	return node;
+}
+
+static int idevice_activation_base64_value(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+
+	return -1;
+}
+
+static plist_t idevice_activation_plist_data_from_base64(const char* str)
+{
+	plist_t plist = NULL;
+	size_t len = strlen(str);
+	unsigned char* data = (unsigned char*) malloc((len / 4) * 3 + 3);
+	size_t size = 0;
+	unsigned int acc = 0;
+	int bits = 0;
+
+	if (!data)
+		return NULL;
+
+	// whitespace and line breaks inside <data> are skipped, decoding
+	// stops at the first padding character
+	for (; *str && *str != '='; str++) {
+		int value = idevice_activation_base64_value((unsigned char) *str);
+		if (value < 0)
+			continue;
+		acc = (acc << 6) | (unsigned int) value;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			data[size++] = (unsigned char) ((acc >> bits) & 0xFF);
+		}
+	}
+
+	plist = plist_new_data((const char*) data, size);
+	free(data);
+
+	return plist;
+}
+
+/* Reads a <real> value, unlike strtod() this does not depend on the
+ * decimal separator of the current locale. */
+static double idevice_activation_plist_real_from_string(const char* str)
+{
+	const char* digits = NULL;
+	double value = 0;
+
+	while (*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n')
+		str++;
+
+	digits = (*str == '-' || *str == '+') ? str + 1 : str;
+	if (!strncasecmp(digits, "nan", 3))
+		return NAN;
+	if (!strncasecmp(digits, "inf", 3))
+		return (*str == '-') ? -INFINITY : INFINITY;
+
+	// XPath numbers take no '+' sign
+	value = xmlXPathStringEvalNumber((const xmlChar*) ((*str == '+') ? digits : str));
+	// malformed numbers read as 0, like with strtod()
+	if (isnan(value))
+		return 0;
+
+	return value;
+}
+
+static plist_t idevice_activation_plist_date_from_string(const char* str)
+{
+	int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+	int64_t days = 0;
+	int y = 0;
+	unsigned int doy = 0, era = 0, yoe = 0;
+
+	if (sscanf(str, " %d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6)
+		return NULL;
+	if (month < 1 || month > 12 || day < 1 || day > 31)
+		return NULL;
+
+	// days since 1970-01-01 of the given (proleptic Gregorian) date
+	y = (month <= 2) ? year - 1 : year;
+	era = (unsigned int) ((y >= 0 ? y : y - 399) / 400);
+	yoe = (unsigned int) (y - (int) era * 400);
+	doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	days = (int64_t) era * 146097 + (int64_t) (yoe * 365 + yoe / 4 - yoe / 100 + doy) - 719468;
+
+	// plist dates count from 2001-01-01
+	return plist_new_date((int32_t) (days * 86400 + hour * 3600 + minute * 60 + second - 978307200), 0);
+}
+
+static plist_t idevice_activation_plist_from_node(xmlNodePtr node, int depth)
+{
+	plist_t plist = NULL;
+	xmlNodePtr child = NULL;
+	xmlChar* content = NULL;
+
+	if (depth > PLIST_NODE_MAX_DEPTH)
+		return NULL;
+
+	if (idevice_activation_plist_node_is(node, "dict")) {
+		plist = plist_new_dict();
+		for (child = idevice_activation_plist_node_next(node->children); child; child = idevice_activation_plist_node_next(child->next)) {
+			xmlNodePtr value_node = NULL;
+			plist_t value = NULL;
+
+			if (!idevice_activation_plist_node_is(child, "key"))
+				goto error;
+
+			value_node = idevice_activation_plist_node_next(child->next);
+			value = idevice_activation_plist_from_node(value_node, depth + 1);
+			if (!value)
+				goto error;
+
+			content = xmlNodeGetContent(child);
+			plist_dict_set_item(plist, (content) ? (const char*) content : "", value);
+			if (content) {
+				xmlFree(content);
+				content = NULL;
+			}
+			child = value_node;
+		}
+	} else if (idevice_activation_plist_node_is(node, "array")) {
+		plist = plist_new_array();
+		for (child = idevice_activation_plist_node_next(node->children); child; child = idevice_activation_plist_node_next(child->next)) {
+			plist_t value = idevice_activation_plist_from_node(child, depth + 1);
+			if (!value)
+				goto error;
+			plist_array_append_item(plist, value);
+		}
+	} else if (idevice_activation_plist_node_is(node, "true")) {
+		plist = plist_new_bool(1);
+	} else if (idevice_activation_plist_node_is(node, "false")) {
+		plist = plist_new_bool(0);
+	} else if (node && node->type == XML_ELEMENT_NODE) {
+		content = xmlNodeGetContent(node);
+		if (!content)
+			return NULL;
+
+		if (!xmlStrcmp(node->name, (const xmlChar*) "string")) {
+			plist = plist_new_string((const char*) content);
+		} else if (!xmlStrcmp(node->name, (const xmlChar*) "data")) {
+			plist = idevice_activation_plist_data_from_base64((const char*) content);
+		} else if (!xmlStrcmp(node->name, (const xmlChar*) "integer")) {
+			const char* str = (const char*) content;
+			uint64_t value = 0;
+			while (*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n')
+				str++;
+			if (*str == '-') {
+				value = (uint64_t) strtoll(str, NULL, 0);
+			} else {
+				value = strtoull(str, NULL, 0);
+			}
+			// like plist_from_xml(), only values above INT64_MAX are unsigned
+			if (*str != '-' && value > INT64_MAX) {
+				plist = plist_new_uint(value);
+			} else {
+#ifdef HAVE_PLIST_NEW_INT
+				plist = plist_new_int((int64_t) value);
+#else
+				// plist_new_uint() may store these as 128 bit integers
+				plist = plist_new_uint(0);
+				plist_set_uint_val(plist, value);
+#endif
+			}
+		} else if (!xmlStrcmp(node->name, (const xmlChar*) "real")) {
+			plist = plist_new_real(idevice_activation_plist_real_from_string((const char*) content));
+		} else if (!xmlStrcmp(node->name, (const xmlChar*) "date")) {
+			plist = idevice_activation_plist_date_from_string((const char*) content);
+		}
+
+		xmlFree(content);
+	}
+
+	return plist;
+
+error:
+	if (content)
+		xmlFree(content);
+	plist_free(plist);
+
+	return NULL;
+}
+
+static plist_t idevice_activation_plist_from_xml_node(xmlNodePtr node)
+{
+	// <plist> wraps exactly one value
+	if (!idevice_activation_plist_node_is(node, "plist"))
+		return NULL;
+
+	return idevice_activation_plist_from_node(idevice_activation_plist_node_next(node->children), 0);
+}
+
+static idevice_activation_error_t idevice_activation_parse_html_response(idevice_activation_response_t response)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	xmlDocPtr doc = NULL;
+	xmlXPathContextPtr context = NULL;
+	xmlXPathObjectPtr xpath_result = NULL;
+
+	if (response->content_type != IDEVICE_ACTIVATION_CONTENT_TYPE_HTML)
+		return IDEVICE_ACTIVATION_E_UNKNOWN_CONTENT_TYPE;
+
+	doc = idevice_activation_response_get_doc(response);
+	if (!doc) {
+		result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
+		goto cleanup;
+	}
+
+	context = xmlXPathNewContext(doc);
+	if (!context) {
+		result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
+		goto cleanup;
+	}
+
+	// check for authentication required
+	if (xpath_result) {
+		xmlXPathFreeObject(xpath_result);
+		xpath_result = NULL;
+	}
+	xpath_result = idevice_activation_xpath_eval(XPATH_HTML_AUTH_REQUIRED, context);
+	if (!xpath_result) {
+		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		goto cleanup;
+	}
+
+	if (xpath_result->nodesetval && xpath_result->nodesetval->nodeNr) {
+		response->is_auth_required = 1;
+		goto cleanup;
+	}
+
+	// check for plist content
+	xmlXPathFreeObject(xpath_result);
+	xpath_result = idevice_activation_xpath_eval(XPATH_HTML_PLIST, context);
+	if (!xpath_result) {
+		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		goto cleanup;
+	}
+
+	if (xpath_result->nodesetval && xpath_result->nodesetval->nodeNr) {
+		// build the plist straight from the parsed nodes instead of
+		// dumping the subtree to text and parsing that again
+		plist_t plist = idevice_activation_plist_from_xml_node(xpath_result->nodesetval->nodeTab[0]);
+		if (!plist) {
+			result = IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
+			goto cleanup;
+		}
+		result = idevice_activation_activation_record_from_plist(response, plist);
+		plist_free(plist);
+		goto cleanup;
+	}
+
+	response->has_errors = 1;
+
+cleanup:
+	if (xpath_result)
+		xmlXPathFreeObject(xpath_result);
+	if (context)
+		xmlXPathFreeContext(context);
+	if (doc)
+		xmlFreeDoc(doc);
+
+	return result;
+}
+
+#define IDEVICE_ACTIVATION_SNIFF_MAX_SIZE 1024
+
+static const char* idevice_activation_sniff_find(const char* p, const char* end, const char* needle)
+{
+	const size_t needle_len = strlen(needle);
+
+	while ((size_t)(end - p) >= needle_len) {
+		if (memcmp(p, needle, needle_len) == 0)
+			return p + needle_len;
+		p++;
+	}
+
+	return NULL;
+}
+
+static int idevice_activation_sniff_name(const char* p, const char* end, const char* name)
+{
+	const size_t name_len = strlen(name);
+
+	if ((size_t)(end - p) <= name_len || strncasecmp(p, name, name_len) != 0)
+		return 0;
+
+	p += name_len;
+	return (*p == '>' || *p == '/' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n');
+}
+
+static idevice_activation_content_type_t idevice_activation_sniff_content_type(const char* content, size_t size)
+{
+	const char* p = content;
+	const char* end = NULL;
+
+	if (!content)
+		return IDEVICE_ACTIVATION_CONTENT_TYPE_UNKNOWN;
+
+	if (idevice_activation_is_binary_plist(content, size))
+		return IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST_BINARY;
+
+	end = content + ((size > IDEVICE_ACTIVATION_SNIFF_MAX_SIZE) ? IDEVICE_ACTIVATION_SNIFF_MAX_SIZE : size);
+
+	// UTF-8 byte order mark
+	if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+		p += 3;
+
+	// skip the XML declaration, comments and unknown doctypes up to the
+	// root element, the root (or doctype) name decides
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+			p++;
+		if (p >= end || *p != '<')
+			break;
+
+		if (end - p >= 2 && p[1] == '?') {
+			p = idevice_activation_sniff_find(p, end, "?>");
+		} else if (end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+			p = idevice_activation_sniff_find(p, end, "-->");
+		} else if (end - p >= 9 && strncasecmp(p, "<!DOCTYPE", 9) == 0) {
+			p += 9;
+			while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+				p++;
+			if (idevice_activation_sniff_name(p, end, "html"))
+				return IDEVICE_ACTIVATION_CONTENT_TYPE_HTML;
+			if (idevice_activation_sniff_name(p, end, "plist"))
+				return IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
+			p = idevice_activation_sniff_find(p, end, ">");
+		} else {
+			p++;
+			if (idevice_activation_sniff_name(p, end, "plist"))
+				return IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
+			if (idevice_activation_sniff_name(p, end, "xmlui"))
+				return IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML;
+			if (idevice_activation_sniff_name(p, end, "html"))
+				return IDEVICE_ACTIVATION_CONTENT_TYPE_HTML;
+			break;
+		}
+		if (!p)
+			break;
+	}
+
+	return IDEVICE_ACTIVATION_CONTENT_TYPE_UNKNOWN;
+}
+
+static int idevice_activation_is_plist_content_type(idevice_activation_content_type_t content_type)
+{
+	return (content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST || content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST_BINARY);
+}
+
+static idevice_activation_error_t idevice_activation_parse_raw_content(idevice_activation_response_t response)
+{
+	idevice_activation_response_finish_stream(response);
+
+	// servers and proxies do not always get the Content-Type right
+	idevice_activation_content_type_t sniffed = idevice_activation_sniff_content_type(response->raw_content, response->raw_content_size);
+	if (sniffed != IDEVICE_ACTIVATION_CONTENT_TYPE_UNKNOWN && sniffed != response->content_type
+	    && !(idevice_activation_is_plist_content_type(sniffed) && idevice_activation_is_plist_content_type(response->content_type))) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: content type %d announced, content looks like %d\n", __func__, response->content_type, sniffed);
+		response->content_type = sniffed;
+		// a document built while receiving used the wrong parser options
+		xmlFreeDoc(response->doc);
+		response->doc = NULL;
+	}
+
 	switch(response->content_type)
 	{
 		case IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST:
+		case IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST_BINARY:
 		{
 			idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
 
-			plist_t plist = NULL;
-			plist_from_xml(response->raw_content, response->raw_content_size, &plist);
+			plist_t plist = NULL;
+			if (response->raw_content_size > UINT32_MAX) {
+				return IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
+			}
+			// go by the content itself, servers are not always exact about the type
+			if (idevice_activation_is_binary_plist(response->raw_content, response->raw_content_size)) {
+				plist_from_bin(response->raw_content, response->raw_content_size, &plist);
+			} else {
+				plist_from_xml(response->raw_content, response->raw_content_size, &plist);
+			}
+
+			if (plist == NULL) {
+				return IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
+			}
+
+			/* check if this is a reply to drmHandshake request */
+			if (plist_dict_get_item(plist, "HandshakeResponseMessage") != NULL) {
+				result = IDEVICE_ACTIVATION_E_SUCCESS;
+			} else {
+				result = idevice_activation_activation_record_from_plist(response, plist);
+			}
+
+			plist_free(response->fields);
+			response->fields = plist;
+
+			return result;
+		}
+		case IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML:
+			return idevice_activation_parse_buddyml_response(response);
+		case IDEVICE_ACTIVATION_CONTENT_TYPE_HTML:
+			return idevice_activation_parse_html_response(response);
+		default:
+			return IDEVICE_ACTIVATION_E_UNKNOWN_CONTENT_TYPE;
+	}
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+static idevice_activation_error_t idevice_activation_parse_raw_response(idevice_activation_response_t response)
+{
+	uint64_t start = idevice_activation_get_time_us();
+	idevice_activation_error_t result = idevice_activation_parse_raw_content(response);
+	response->timings.parse = (double)(idevice_activation_get_time_us() - start) / 1000000.0;
+
+	return result;
+}
+
+static void idevice_activation_response_ensure_parsed(idevice_activation_response_t response)
+{
+	if (!response->parse_pending)
+		return;
+
+	response->parse_pending = 0;
+	response->parse_result = idevice_activation_parse_raw_response(response);
+}
+
+#define IDEVICE_ACTIVATION_RAW_CONTENT_MIN_CAPACITY 4096
+#define IDEVICE_ACTIVATION_RAW_CONTENT_MAX_PREALLOC (64 * 1024 * 1024)
+
+static int idevice_activation_response_reserve(idevice_activation_response_t response, size_t capacity)
+{
+	size_t new_capacity = response->raw_content_capacity;
+
+	if (capacity <= new_capacity)
+		return 0;
+
+	if (new_capacity < IDEVICE_ACTIVATION_RAW_CONTENT_MIN_CAPACITY) {
+		new_capacity = IDEVICE_ACTIVATION_RAW_CONTENT_MIN_CAPACITY;
+	}
+	while (new_capacity < capacity) {
+		if (new_capacity > ((size_t)-1) / 2) {
+			new_capacity = capacity;
+			break;
+		}
+		new_capacity *= 2;
+	}
+
+	char* new_content = (char*) realloc(response->raw_content, new_capacity);
+	if (!new_content)
+		return -1;
+
+	response->raw_content = new_content;
+	response->raw_content_capacity = new_capacity;
+
+	return 0;
+}
+
+static size_t idevice_activation_write_callback(char* data, size_t size, size_t nmemb, void* userdata)
+{
+	idevice_activation_response_t response = (idevice_activation_response_t)userdata;
+	const size_t total = size * nmemb;
+
+	if (total != 0) {
+		// keep room for the terminating '\0'
+		if (idevice_activation_response_reserve(response, response->raw_content_size + total + 1) < 0) {
+			return 0;
+		}
+		memcpy(response->raw_content + response->raw_content_size, data, total);
+		response->raw_content[response->raw_content_size + total] = '\0';
+		response->raw_content_size += total;
+
+		if (response->streaming_parse) {
+			idevice_activation_response_stream_chunk(response, data, total);
+		}
+	}
+
+	return total;
+}
+
+static int idevice_activation_header_is(const char* name, size_t name_len, const char* known)
+{
+	return (strlen(known) == name_len && strncasecmp(name, known, name_len) == 0);
+}
+
+static size_t idevice_activation_header_callback(void *data, size_t size, size_t nmemb, void *userdata)
+{
+	idevice_activation_response_t response = (idevice_activation_response_t)userdata;
+	const size_t total = size * nmemb;
+	const char* line = (const char*) data;
+	const char* colon = NULL;
+	const char* value = NULL;
+	const char* end = line + total;
+	size_t name_len = 0;
+	size_t value_len = 0;
+
+	// a new status line starts the header of the next response when
+	// redirects are followed, Location is kept to tell where they led
+	if (total > 5 && memcmp(line, "HTTP/", 5) == 0) {
+		response->content_length = 0;
+		response->retry_after = NULL;
+		return total;
+	}
+
+	// the status line and the blank line ending the header have no colon
+	colon = (const char*) memchr(line, ':', total);
+	if (!colon)
+		return total;
+
+	name_len = colon - line;
+	value = colon + 1;
+	while (value < end && (*value == ' ' || *value == '\t')) {
+		value++;
+	}
+	while (end > value && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+	value_len = end - value;
+	if (value_len == 0)
+		return total;
+
+	// keep a single copy of name and value, everything else points into it
+	struct idevice_activation_header* header = (struct idevice_activation_header*) idevice_activation_arena_alloc(&response->arena, sizeof(struct idevice_activation_header) + name_len + value_len + 2);
+	if (!header)
+		return 0;
+
+	char* name_copy = (char*)(header + 1);
+	char* value_copy = name_copy + name_len + 1;
+	memcpy(name_copy, line, name_len);
+	name_copy[name_len] = '\0';
+	memcpy(value_copy, value, value_len);
+	value_copy[value_len] = '\0';
+	header->name = name_copy;
+	header->value = value_copy;
+	header->next = NULL;
+	*response->headers_tail = header;
+	response->headers_tail = &header->next;
+
+	if (idevice_activation_header_is(line, name_len, "Content-Type")) {
+		if (strncasecmp(value_copy, "text/xml", 8) == 0) {
+			response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
+		} else if (strncasecmp(value_copy, "application/xml", 15) == 0) {
+			response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
+		} else if (strncasecmp(value_copy, "application/x-bplist", 20) == 0) {
+			response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST_BINARY;
+		} else if (strncasecmp(value_copy, "application/x-apple-binary-plist", 32) == 0) {
+			response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST_BINARY;
+		} else if (strncasecmp(value_copy, "application/x-buddyml", 21) == 0) {
+			response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML;
+		} else if (strncasecmp(value_copy, "text/html", 9) == 0) {
+			response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_HTML;
+		}
+	} else if (idevice_activation_header_is(line, name_len, "Content-Length")) {
+		// only a hint, it is the encoded size and might belong to a redirect
+		unsigned long long length = strtoull(value_copy, NULL, 10);
+		response->content_length = length;
+		if (length > 0 && length < IDEVICE_ACTIVATION_RAW_CONTENT_MAX_PREALLOC) {
+			idevice_activation_response_reserve(response, (size_t)length + 1);
+		}
+	} else if (idevice_activation_header_is(line, name_len, "Retry-After")) {
+		response->retry_after = value_copy;
+	} else if (idevice_activation_header_is(line, name_len, "Location")) {
+		response->location = value_copy;
+	}
+
+	return total;
+}
+
+static const signed char urlencode_table[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
+	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+static size_t urlencode_len(const char* buf, size_t len)
+{
+	size_t i;
+	size_t newlen = len;
+
+	for (i = 0; i < len; i++) {
+		if (urlencode_table[(unsigned char)buf[i]]) {
+			newlen += 2;
+		}
+	}
+
+	return newlen;
+}
+
+static char* urlencode_to(char* out, const char* buf, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		const unsigned char c = (unsigned char)buf[i];
+		if (urlencode_table[c]) {
+			*out++ = '%';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0x0F];
+		} else {
+			*out++ = (char)c;
+		}
+	}
+
+	return out;
+}
+
+/* prefix holds fields that are already encoded and goes in front */
+static idevice_activation_error_t idevice_activation_build_urlencoded_body(const char* prefix, size_t prefix_size, plist_t fields, char** body, size_t* body_size)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	plist_dict_iter iter = NULL;
+	char* key = NULL;
+	plist_t value_node = NULL;
+	size_t size = prefix_size;
+	char* postdata = NULL;
+	char* p = NULL;
+	int pass;
+
+	// the first pass measures and validates, the second one writes into
+	// a buffer of the exact size
+	for (pass = 0; pass < 2; pass++) {
+		plist_dict_new_iter(fields, &iter);
+		if (!iter) {
+			result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+			goto cleanup;
+		}
+		do {
+			key = NULL;
+			value_node = NULL;
+			plist_dict_next_item(fields, iter, &key, &value_node);
+			if (key && value_node) {
+				uint64_t value_len = 0;
+				const char* value = NULL;
+				const size_t key_len = strlen(key);
+
+				// only strings supported
+				if (plist_get_node_type(value_node) != PLIST_STRING) {
+					result = IDEVICE_ACTIVATION_E_UNSUPPORTED_FIELD_TYPE;
+					goto cleanup;
+				}
+				value = plist_get_string_ptr(value_node, &value_len);
+
+				if (pass == 0) {
+					size += key_len + 1 + urlencode_len(value, (size_t)value_len) + 1;
+				} else {
+					if (p != postdata) {
+						*p++ = '&';
+					}
+					memcpy(p, key, key_len);
+					p += key_len;
+					*p++ = '=';
+					p = urlencode_to(p, value, (size_t)value_len);
+				}
+			}
+			free(key);
+			key = NULL;
+		} while (value_node);
+		free(iter);
+		iter = NULL;
+
+		if (pass == 0) {
+			// one '&' less than fields, which leaves room for the '\0'
+			postdata = (char*) malloc(size + 1);
+			if (!postdata) {
+				result = IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+				goto cleanup;
+			}
+			if (prefix_size > 0) {
+				memcpy(postdata, prefix, prefix_size);
+			}
+			p = postdata + prefix_size;
+		}
+	}
+	*p = '\0';
+
+	*body = postdata;
+	*body_size = p - postdata;
+	postdata = NULL;
+
+cleanup:
+	free(key);
+	free(iter);
+	free(postdata);
+
+	return result;
+}
+
+/* Growable, always NUL-terminated output buffer */
+struct idevice_activation_buffer {
+	char* data;
+	size_t size;
+	size_t capacity;
+};
+
+static int idevice_activation_buffer_reserve(struct idevice_activation_buffer* buf, size_t len)
+{
+	size_t capacity = buf->capacity;
+	char* data = NULL;
+
+	if (buf->size + len < capacity)
+		return 0;
+
+	if (capacity < 256)
+		capacity = 256;
+	while (buf->size + len >= capacity)
+		capacity *= 2;
+
+	data = (char*) realloc(buf->data, capacity);
+	if (!data)
+		return -1;
+
+	buf->data = data;
+	buf->capacity = capacity;
+
+	return 0;
+}
+
+static int idevice_activation_buffer_append(struct idevice_activation_buffer* buf, const char* str, size_t len)
+{
+	if (idevice_activation_buffer_reserve(buf, len) < 0)
+		return -1;
+
+	memcpy(buf->data + buf->size, str, len);
+	buf->size += len;
+	buf->data[buf->size] = '\0';
+
+	return 0;
+}
+
+#define idevice_activation_buffer_append_str(buf, str) idevice_activation_buffer_append(buf, str, sizeof(str) - 1)
+
+static int idevice_activation_buffer_indent(struct idevice_activation_buffer* buf, unsigned int depth)
+{
+	if (idevice_activation_buffer_reserve(buf, depth) < 0)
+		return -1;
+
+	memset(buf->data + buf->size, '\t', depth);
+	buf->size += depth;
+	buf->data[buf->size] = '\0';
+
+	return 0;
+}
+
+static int idevice_activation_buffer_append_escaped(struct idevice_activation_buffer* buf, const char* str, size_t len)
+{
+	const char* end = str + len;
+	const char* run = str;
+
+	for (; str < end; str++) {
+		const char* entity = NULL;
+		switch (*str) {
+			case '<':
+				entity = "&lt;";
+				break;
+			case '>':
+				entity = "&gt;";
+				break;
+			case '&':
+				entity = "&amp;";
+				break;
+			default:
+				continue;
+		}
+		if (idevice_activation_buffer_append(buf, run, str - run) < 0)
+			return -1;
+		if (idevice_activation_buffer_append(buf, entity, strlen(entity)) < 0)
+			return -1;
+		run = str + 1;
+	}
+
+	return idevice_activation_buffer_append(buf, run, end - run);
+}
+
+static int idevice_activation_buffer_append_base64(struct idevice_activation_buffer* buf, const unsigned char* data, size_t len)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char* out = NULL;
+	size_t i;
+
+	if (idevice_activation_buffer_reserve(buf, ((len + 2) / 3) * 4) < 0)
+		return -1;
+
+	out = buf->data + buf->size;
+	for (i = 0; i + 2 < len; i += 3) {
+		*out++ = alphabet[data[i] >> 2];
+		*out++ = alphabet[((data[i] & 0x03) << 4) | (data[i+1] >> 4)];
+		*out++ = alphabet[((data[i+1] & 0x0F) << 2) | (data[i+2] >> 6)];
+		*out++ = alphabet[data[i+2] & 0x3F];
+	}
+	if (i < len) {
+		*out++ = alphabet[data[i] >> 2];
+		if (i + 1 < len) {
+			*out++ = alphabet[((data[i] & 0x03) << 4) | (data[i+1] >> 4)];
+			*out++ = alphabet[(data[i+1] & 0x0F) << 2];
+		} else {
+			*out++ = alphabet[(data[i] & 0x03) << 4];
+			*out++ = '=';
+		}
+		*out++ = '=';
+	}
+	buf->size = out - buf->data;
+	buf->data[buf->size] = '\0';
+
+	return 0;
+}
+
+static int idevice_activation_buffer_append_date(struct idevice_activation_buffer* buf, int32_t sec)
+{
+	char str[64];
+	int64_t t = (int64_t) sec + 978307200;
+	int64_t days = (t >= 0 ? t : t - 86399) / 86400;
+	int64_t secs = t - days * 86400;
+	int64_t era = 0;
+	unsigned int doe = 0, yoe = 0, doy = 0, mp = 0;
+	int64_t year = 0;
+	unsigned int month = 0, day = 0;
+
+	// civil date from days since 1970-01-01, the inverse of
+	// idevice_activation_plist_date_from_string()
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = (unsigned int) (days - era * 146097);
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	month = (mp < 10) ? mp + 3 : mp - 9;
+	year = (int64_t) yoe + era * 400 + (month <= 2);
+
+	snprintf(str, sizeof(str), "%04lld-%02u-%02uT%02d:%02d:%02dZ", (long long) year, month, day, (int) (secs / 3600), (int) ((secs / 60) % 60), (int) (secs % 60));
+
+	return idevice_activation_buffer_append(buf, str, strlen(str));
+}
+
+static int idevice_activation_buffer_append_real(struct idevice_activation_buffer* buf, double value)
+{
+	char str[64];
+	int len = 0;
+	int i;
+
+	if (isnan(value)) {
+		len = snprintf(str, sizeof(str), "nan");
+	} else if (isinf(value)) {
+		len = snprintf(str, sizeof(str), "%cinfinity", (value > 0.0) ? '+' : '-');
+	} else if (value == 0.0) {
+		len = snprintf(str, sizeof(str), "0.0");
+	} else {
+		len = snprintf(str, sizeof(str), "%.*g", 17, value);
+		// the decimal separator must not depend on the locale
+		for (i = 0; i < len; i++) {
+			if (str[i] == ',') {
+				str[i] = '.';
+				break;
+			}
+		}
+	}
+
+	return idevice_activation_buffer_append(buf, str, len);
+}
+
+/* Writes node as the XML fragment plist_to_xml() would put between the
+ * <plist> tags, with the same layout, straight into buf. */
+static idevice_activation_error_t idevice_activation_plist_write_xml(struct idevice_activation_buffer* buf, plist_t node, unsigned int depth)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	char str[32];
+	int err = 0;
+
+	if (depth > PLIST_NODE_MAX_DEPTH)
+		return IDEVICE_ACTIVATION_E_UNSUPPORTED_FIELD_TYPE;
+
+	switch (plist_get_node_type(node)) {
+		case PLIST_BOOLEAN: {
+			uint8_t value = 0;
+			plist_get_bool_val(node, &value);
+			if (value) {
+				err = idevice_activation_buffer_append_str(buf, "<true/>");
+			} else {
+				err = idevice_activation_buffer_append_str(buf, "<false/>");
+			}
+			break;
+		}
+		case PLIST_UINT: {
+#ifdef HAVE_PLIST_INT_VAL_IS_NEGATIVE
+			// the node knows whether it holds a signed value
+			if (plist_int_val_is_negative(node)) {
+				int64_t value = 0;
+				plist_get_int_val(node, &value);
+				snprintf(str, sizeof(str), "%lld", (long long) value);
+			} else {
+				uint64_t value = 0;
+				plist_get_uint_val(node, &value);
+				snprintf(str, sizeof(str), "%llu", (unsigned long long) value);
+			}
+#else
+			// libplist 2.2 writes every integer as signed
+			uint64_t value = 0;
+			plist_get_uint_val(node, &value);
+			snprintf(str, sizeof(str), "%lld", (long long) value);
+#endif
+			err = idevice_activation_buffer_append_str(buf, "<integer>")
+				|| idevice_activation_buffer_append(buf, str, strlen(str))
+				|| idevice_activation_buffer_append_str(buf, "</integer>");
+			break;
+		}
+		case PLIST_REAL: {
+			double value = 0;
+			plist_get_real_val(node, &value);
+			err = idevice_activation_buffer_append_str(buf, "<real>")
+				|| idevice_activation_buffer_append_real(buf, value)
+				|| idevice_activation_buffer_append_str(buf, "</real>");
+			break;
+		}
+		case PLIST_STRING: {
+			uint64_t length = 0;
+			const char* value = plist_get_string_ptr(node, &length);
+			err = idevice_activation_buffer_append_str(buf, "<string>")
+				|| idevice_activation_buffer_append_escaped(buf, value, (size_t) length)
+				|| idevice_activation_buffer_append_str(buf, "</string>");
+			break;
+		}
+		case PLIST_DATE: {
+			int32_t sec = 0;
+			int32_t usec = 0;
+			plist_get_date_val(node, &sec, &usec);
+			err = idevice_activation_buffer_append_str(buf, "<date>")
+				|| idevice_activation_buffer_append_date(buf, sec)
+				|| idevice_activation_buffer_append_str(buf, "</date>");
+			break;
+		}
+		case PLIST_DATA: {
+			uint64_t length = 0;
+			const unsigned char* value = (const unsigned char*) plist_get_data_ptr(node, &length);
+			// wrapped like libplist does, 76 columns with tabs counted as 8
+			unsigned int indent = (depth > 8) ? 8 : depth;
+			size_t line = ((76 - (indent << 3)) >> 2) * 3;
+			size_t pos = 0;
+			err = idevice_activation_buffer_append_str(buf, "<data>\n");
+			while (!err && pos < length) {
+				size_t count = ((size_t) length - pos < line) ? (size_t) length - pos : line;
+				err = idevice_activation_buffer_indent(buf, indent)
+					|| idevice_activation_buffer_append_base64(buf, value + pos, count)
+					|| idevice_activation_buffer_append_str(buf, "\n");
+				pos += count;
+			}
+			err = err
+				|| idevice_activation_buffer_indent(buf, depth)
+				|| idevice_activation_buffer_append_str(buf, "</data>");
+			break;
+		}
+		case PLIST_ARRAY: {
+			uint32_t count = plist_array_get_size(node);
+			uint32_t i;
+			if (count == 0) {
+				err = idevice_activation_buffer_append_str(buf, "<array/>");
+				break;
+			}
+			err = idevice_activation_buffer_append_str(buf, "<array>\n");
+			for (i = 0; !err && i < count; i++) {
+				if (idevice_activation_buffer_indent(buf, depth + 1) < 0)
+					return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+				result = idevice_activation_plist_write_xml(buf, plist_array_get_item(node, i), depth + 1);
+				if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+					return result;
+				err = idevice_activation_buffer_append_str(buf, "\n");
+			}
+			err = err
+				|| idevice_activation_buffer_indent(buf, depth)
+				|| idevice_activation_buffer_append_str(buf, "</array>");
+			break;
+		}
+		case PLIST_DICT: {
+			plist_dict_iter iter = NULL;
+			char* key = NULL;
+			plist_t value_node = NULL;
+			if (plist_dict_get_size(node) == 0) {
+				err = idevice_activation_buffer_append_str(buf, "<dict/>");
+				break;
+			}
+			plist_dict_new_iter(node, &iter);
+			if (!iter)
+				return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+			err = idevice_activation_buffer_append_str(buf, "<dict>\n");
+			while (!err) {
+				key = NULL;
+				value_node = NULL;
+				plist_dict_next_item(node, iter, &key, &value_node);
+				if (!key || !value_node) {
+					free(key);
+					break;
+				}
+				err = idevice_activation_buffer_indent(buf, depth + 1)
+					|| idevice_activation_buffer_append_str(buf, "<key>")
+					|| idevice_activation_buffer_append_escaped(buf, key, strlen(key))
+					|| idevice_activation_buffer_append_str(buf, "</key>\n")
+					|| idevice_activation_buffer_indent(buf, depth + 1);
+				free(key);
+				if (err)
+					break;
+				result = idevice_activation_plist_write_xml(buf, value_node, depth + 1);
+				if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+					break;
+				err = idevice_activation_buffer_append_str(buf, "\n");
+			}
+			free(iter);
+			if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+				return result;
+			err = err
+				|| idevice_activation_buffer_indent(buf, depth)
+				|| idevice_activation_buffer_append_str(buf, "</dict>");
+			break;
+		}
+		case PLIST_UID: {
+			uint64_t value = 0;
+			plist_get_uid_val(node, &value);
+			snprintf(str, sizeof(str), "%llu", (unsigned long long) value);
+			err = idevice_activation_buffer_append_str(buf, "<dict>\n")
+				|| idevice_activation_buffer_indent(buf, depth + 1)
+				|| idevice_activation_buffer_append_str(buf, "<key>CF$UID</key>\n")
+				|| idevice_activation_buffer_indent(buf, depth + 1)
+				|| idevice_activation_buffer_append_str(buf, "<integer>")
+				|| idevice_activation_buffer_append(buf, str, strlen(str))
+				|| idevice_activation_buffer_append_str(buf, "</integer>\n")
+				|| idevice_activation_buffer_indent(buf, depth)
+				|| idevice_activation_buffer_append_str(buf, "</dict>");
+			break;
+		}
+		default:
+			return IDEVICE_ACTIVATION_E_UNSUPPORTED_FIELD_TYPE;
+	}
+
+	return (err) ? IDEVICE_ACTIVATION_E_OUT_OF_MEMORY : IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+static void idevice_activation_body_free(struct idevice_activation_body* body)
+{
+	unsigned int i;
+
+	for (i = 0; i < body->num_parts; i++) {
+		if (body->parts[i].borrowed)
+			continue;
+		free(body->parts[i].name);
+		free(body->parts[i].buffer);
+	}
+	free(body->parts);
+	free(body->data);
+	memset(body, 0, sizeof(struct idevice_activation_body));
+}
+
+static struct idevice_activation_body_part* idevice_activation_body_next_part(struct idevice_activation_body* body)
+{
+	struct idevice_activation_body_part* parts = NULL;
+	unsigned int num = body->num_parts;
+
+	// room for 8 parts first, doubled whenever that is used up
+	if (num == 0 || (num >= 8 && (num & (num - 1)) == 0)) {
+		unsigned int capacity = (num) ? num * 2 : 8;
+		parts = (struct idevice_activation_body_part*) realloc(body->parts, capacity * sizeof(struct idevice_activation_body_part));
+		if (!parts)
+			return NULL;
+		body->parts = parts;
+	}
+
+	return &body->parts[body->num_parts];
+}
+
+static idevice_activation_error_t idevice_activation_body_add_part(struct idevice_activation_body* body, char* key, plist_t value_node)
+{
+	struct idevice_activation_body_part* part = idevice_activation_body_next_part(body);
+
+	if (!part)
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	memset(part, 0, sizeof(struct idevice_activation_body_part));
+
+	// serialize plist node as field value
+	if (plist_get_node_type(value_node) == PLIST_STRING) {
+		uint64_t length = 0;
+		part->data = plist_get_string_ptr(value_node, &length);
+		part->size = (size_t)length;
+	} else {
+		struct idevice_activation_buffer buf = { NULL, 0, 0 };
+		idevice_activation_error_t result = idevice_activation_plist_write_xml(&buf, value_node, 0);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+			free(buf.data);
+			return result;
+		}
+		part->buffer = buf.data;
+		part->data = buf.data;
+		part->size = buf.size;
+	}
+	part->name = key;
+	body->num_parts++;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+static int idevice_activation_curl_debug_callback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr)
+{
+	switch (type) {
+	case CURLINFO_TEXT:
+		fprintf(stderr, "* ");
+		break;
+	case CURLINFO_DATA_IN:
+	case CURLINFO_HEADER_IN:
+		fprintf(stderr, "< ");
+		break;
+	case CURLINFO_DATA_OUT:
+	case CURLINFO_HEADER_OUT:
+		fprintf(stderr, "> ");
+		break;
+	case CURLINFO_SSL_DATA_IN:
+	case CURLINFO_SSL_DATA_OUT:
+		return 0;
+	default:
+		return 0;
+	}
+
+	fwrite(data, 1, size, stderr);
+	if (size > 0 && data[size-1] != '\n') {
+		fprintf(stderr, "\n");
+	}
+	return 0;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int idevice_activation_progress_callback(void* userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+#else
+static int idevice_activation_progress_callback(void* userdata, double dltotal, double dlnow, double ultotal, double ulnow)
+#endif
+{
+	idevice_activation_cancel_t cancel = (idevice_activation_cancel_t)userdata;
+
+	// a non-zero return makes libcurl abort with CURLE_ABORTED_BY_CALLBACK
+	return idevice_activation_cancel_is_triggered(cancel);
+}
+
+static idevice_activation_error_t idevice_activation_error_from_curl(CURLcode code)
+{
+	switch (code) {
+		case CURLE_OK:
+			return IDEVICE_ACTIVATION_E_SUCCESS;
+		case CURLE_OPERATION_TIMEDOUT:
+			return IDEVICE_ACTIVATION_E_TIMEOUT;
+		case CURLE_ABORTED_BY_CALLBACK:
+			return IDEVICE_ACTIVATION_E_CANCELLED;
+		case CURLE_OUT_OF_MEMORY:
+			return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+		default:
+			return IDEVICE_ACTIVATION_E_CONNECTION_FAILED;
+	}
+}
+
+static idevice_activation_request_t idevice_activation_request_alloc(idevice_activation_client_type_t client_type, idevice_activation_content_type_t content_type, const char* url)
+{
+	idevice_activation_request_t tmp_request = (idevice_activation_request_t) calloc(1, sizeof(idevice_activation_request));
+
+	if (!tmp_request) {
+		return NULL;
+	}
+
+	tmp_request->client_type = client_type;
+	tmp_request->content_type = content_type;
+	tmp_request->url = strdup(url);
+	tmp_request->compression = 1;
+
+	return tmp_request;
+}
+
+idevice_activation_error_t idevice_activation_request_new(idevice_activation_client_type_t client_type, idevice_activation_request_t* request)
+{
+	if (!request)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	idevice_activation_request_t tmp_request = idevice_activation_request_alloc(client_type, IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED, IDEVICE_ACTIVATION_DEFAULT_URL);
+
+	if (!tmp_request) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	tmp_request->fields = plist_new_dict();
+	*request = tmp_request;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+idevice_activation_error_t idevice_activation_request_new_from_lockdownd(idevice_activation_client_type_t client_type, lockdownd_client_t lockdown, idevice_activation_request** request)
+{
+	if (!lockdown || !request) {
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	}
+
+	uint8_t has_telephony_capability = 0;
+	uint8_t has_mobile_equipment_id = 0;
+	lockdownd_error_t err;
+	plist_t info = NULL;
+	plist_t node = NULL;
+	plist_t fields = plist_new_dict();
+
+	// add InStoreActivation
+	plist_dict_set_item(fields, "InStoreActivation", plist_new_string("false"));
+
+	// get a bunch of information at once
+	err = lockdownd_get_value(lockdown, NULL, NULL, &info);
+	if (err != LOCKDOWN_E_SUCCESS) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: Unable to get basic information from lockdownd\n", __func__);
+		plist_free(fields);
+		return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+	}
+
+	// add AppleSerialNumber
+	node = plist_dict_get_item(info, "SerialNumber");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: Unable to get SerialNumber from lockdownd\n", __func__);
+		plist_free(fields);
+		plist_free(info);
+		return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+	}
+	plist_dict_set_item(fields, "AppleSerialNumber", plist_copy(node));
+	node = NULL;
+
+
+	// check if device has telephone capability
+	node = plist_dict_get_item(info, "TelephonyCapability");
+	if (!node || plist_get_node_type(node) != PLIST_BOOLEAN) {
+		has_telephony_capability = 0;
+	} else {
+		plist_get_bool_val(node, &has_telephony_capability);
+	}
+	node = NULL;
+
+	if (has_telephony_capability) {
+		// add IMEI
+		node = plist_dict_get_item(info, "InternationalMobileEquipmentIdentity");
+		if (!node || plist_get_node_type(node) != PLIST_STRING) {
+			has_mobile_equipment_id = 0;
+		} else {
+			plist_dict_set_item(fields, "IMEI", plist_copy(node));
+			has_mobile_equipment_id = 1;
+		}
+		node = NULL;
+
+		// add MEID
+		node = plist_dict_get_item(info, "MobileEquipmentIdentifier");
+		if (!node || plist_get_node_type(node) != PLIST_STRING) {
+			if (debug_level > 0)
+				fprintf(stderr, "%s: Unable to get MEID from lockdownd\n", __func__);
+			if (!has_mobile_equipment_id) {
+				plist_free(fields);
+				plist_free(info);
+				return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+			}
+		} else {
+			plist_dict_set_item(fields, "MEID", plist_copy(node));
+		}
+		node = NULL;
+
+		// add IMSI
+		node = plist_dict_get_item(info, "InternationalMobileSubscriberIdentity");
+		if (!node || plist_get_node_type(node) != PLIST_STRING) {
+			if (debug_level > 0)
+				fprintf(stderr, "%s: Unable to get IMSI from lockdownd\n", __func__);
+		} else {
+			plist_dict_set_item(fields, "IMSI", plist_copy(node));
+		}
+		node = NULL;
+
+		// add ICCID
+		node = plist_dict_get_item(info, "IntegratedCircuitCardIdentity");
+		if (!node || plist_get_node_type(node) != PLIST_STRING) {
+			if (debug_level > 0)
+				fprintf(stderr, "%s: Unable to get ICCID from lockdownd\n", __func__);
+		} else {
+			plist_dict_set_item(fields, "ICCID", plist_copy(node));
+		}
+		node = NULL;
+	}
+	plist_free(info);
+	info = NULL;
+
+	// add activation-info
+	err = lockdownd_get_value(lockdown, NULL, "ActivationInfo", &node);
+	if (err != LOCKDOWN_E_SUCCESS || !node || plist_get_node_type(node) != PLIST_DICT) {
+		fprintf(stderr, "%s: Unable to get ActivationInfo from lockdownd\n", __func__);
+		plist_free(fields);
+		return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+	}
+	plist_dict_set_item(fields, "activation-info", plist_copy(node));
+	plist_free(node);
+	node = NULL;
+
+	idevice_activation_request* tmp_request = idevice_activation_request_alloc(client_type, IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA, IDEVICE_ACTIVATION_DEFAULT_URL);
+
+	if (!tmp_request) {
+		plist_free(fields);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	tmp_request->fields = fields;
+	*request = tmp_request;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+idevice_activation_error_t idevice_activation_drm_handshake_request_new(idevice_activation_client_type_t client_type, idevice_activation_request_t* request)
+{
+	if (!request)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	idevice_activation_request_t tmp_request = idevice_activation_request_alloc(client_type, IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST, IDEVICE_ACTIVATION_DRM_HANDSHAKE_DEFAULT_URL);
+
+	if (!tmp_request) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	tmp_request->fields = plist_new_dict();
+	*request = tmp_request;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+static void idevice_activation_request_template_release(idevice_activation_request_template_t request_template)
+{
+	unsigned int refcount = 0;
+
+	idevice_activation_mutex_lock(&request_template->lock);
+	refcount = --request_template->refcount;
+	idevice_activation_mutex_unlock(&request_template->lock);
+	if (refcount > 0)
+		return;
+
+	free(request_template->request.url);
+	plist_free(request_template->request.fields);
+	idevice_activation_body_free(&request_template->request.body);
+	idevice_activation_mutex_destroy(&request_template->lock);
+	free(request_template);
+}
+
+static plist_t idevice_activation_request_copy_fields(idevice_activation_request_t request)
+{
+	plist_t fields = NULL;
+
+	if (!request->shared)
+		return plist_copy(request->fields);
+
+	fields = plist_copy(request->shared->request.fields);
+	if (fields) {
+		plist_dict_merge(&fields, request->fields);
+	}
+
+	return fields;
+}
+
+/* Gives the request its own copy of the template fields, needed once it
+ * overwrites one of them or its body can not build on the template body. */
+static idevice_activation_error_t idevice_activation_request_unshare(idevice_activation_request_t request)
+{
+	plist_t fields = NULL;
+
+	if (!request->shared)
+		return IDEVICE_ACTIVATION_E_SUCCESS;
+
+	fields = idevice_activation_request_copy_fields(request);
+	if (!fields)
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+
+	idevice_activation_body_free(&request->body);
+	plist_free(request->fields);
+	request->fields = fields;
+	idevice_activation_request_template_release(request->shared);
+	request->shared = NULL;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+static int idevice_activation_request_overwrites_shared(idevice_activation_request_t request, plist_t fields)
+{
+	plist_dict_iter iter = NULL;
+	char* key = NULL;
+	plist_t item = NULL;
+	int found = 0;
+
+	if (!request->shared)
+		return 0;
+
+	plist_dict_new_iter(fields, &iter);
+	if (!iter)
+		return 1;
+	do {
+		key = NULL;
+		item = NULL;
+		plist_dict_next_item(fields, iter, &key, &item);
+		if (key && plist_dict_get_item(request->shared->request.fields, key)) {
+			found = 1;
+		}
+		free(key);
+	} while (item && !found);
+	free(iter);
+
+	return found;
+}
+
+void idevice_activation_request_free(idevice_activation_request_t request)
+{
+	if (!request)
+		return;
+
+	free(request->url);
+	plist_free(request->fields);
+	idevice_activation_body_free(&request->body);
+	if (request->shared) {
+		idevice_activation_request_template_release(request->shared);
+	}
+	free(request);
+}
+
+idevice_activation_error_t idevice_activation_request_template_new(idevice_activation_request_t request, idevice_activation_request_template_t* request_template)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	idevice_activation_request_template_t tmp_template = NULL;
+
+	if (!request || !request_template)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	tmp_template = (idevice_activation_request_template_t) calloc(1, sizeof(idevice_activation_request_template));
+	if (!tmp_template)
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+
+	tmp_template->request = *request;
+	memset(&tmp_template->request.body, 0, sizeof(struct idevice_activation_body));
+	tmp_template->request.shared = NULL;
+	// the handle belongs to the caller and would be shared by all forks
+	tmp_template->request.cancel = NULL;
+	tmp_template->request.url = strdup(request->url);
+	tmp_template->request.fields = idevice_activation_request_copy_fields(request);
+	if (!tmp_template->request.url || !tmp_template->request.fields) {
+		free(tmp_template->request.url);
+		plist_free(tmp_template->request.fields);
+		free(tmp_template);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	// forked requests build on this body
+	result = idevice_activation_request_serialize(&tmp_template->request);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		free(tmp_template->request.url);
+		plist_free(tmp_template->request.fields);
+		free(tmp_template);
+		return result;
+	}
+
+	tmp_template->refcount = 1;
+	idevice_activation_mutex_init(&tmp_template->lock);
+	*request_template = tmp_template;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+idevice_activation_error_t idevice_activation_request_new_from_template(idevice_activation_request_template_t request_template, idevice_activation_request_t* request)
+{
+	idevice_activation_request_t tmp_request = NULL;
+
+	if (!request_template || !request)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	tmp_request = (idevice_activation_request_t) malloc(sizeof(idevice_activation_request));
+	if (!tmp_request)
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+
+	*tmp_request = request_template->request;
+	memset(&tmp_request->body, 0, sizeof(struct idevice_activation_body));
+	tmp_request->url = strdup(request_template->request.url);
+	tmp_request->fields = plist_new_dict();
+	if (!tmp_request->url || !tmp_request->fields) {
+		free(tmp_request->url);
+		plist_free(tmp_request->fields);
+		free(tmp_request);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	idevice_activation_mutex_lock(&request_template->lock);
+	request_template->refcount++;
+	idevice_activation_mutex_unlock(&request_template->lock);
+	tmp_request->shared = request_template;
+
+	*request = tmp_request;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+void idevice_activation_request_template_free(idevice_activation_request_template_t request_template)
+{
+	if (!request_template)
+		return;
+
+	idevice_activation_request_template_release(request_template);
+}
+
+void idevice_activation_request_get_fields(idevice_activation_request_t request, plist_t* fields)
+{
+	if (!request || !fields)
+		return;
+
+	*fields = idevice_activation_request_copy_fields(request);
+}
+
+void idevice_activation_request_set_fields(idevice_activation_request_t request, plist_t fields)
+{
+	if (!request || !fields)
+		return;
+
+	if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED) {
+		// if at least one of the new fields has a different type than string, we have to change the type
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(fields, &iter);
+		plist_t item = NULL;
+		do {
+			plist_dict_next_item(fields, iter, NULL, &item);
+			if (item && plist_get_node_type(item) != PLIST_STRING) {
+				request->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA;
+				break;
+			}
+		} while(item);
+		free(iter);
+	}
+
+	if (idevice_activation_request_overwrites_shared(request, fields)) {
+		if (idevice_activation_request_unshare(request) != IDEVICE_ACTIVATION_E_SUCCESS)
+			return;
+	}
+	idevice_activation_body_free(&request->body);
+	plist_dict_merge(&request->fields, fields);
+}
+
+void idevice_activation_request_set_fields_from_response(idevice_activation_request_t request, const idevice_activation_response_t response)
+{
+	if (!request || !response)
+		return;
+
+	plist_t response_fields = NULL;
+	idevice_activation_response_get_fields(response, &response_fields);
+	if (response_fields) {
+		idevice_activation_request_set_fields(request, response_fields);
+		plist_free(response_fields);
+	}
+}
+
+void idevice_activation_request_set_field(idevice_activation_request_t request, const char* key, const char* value)
+{
+	if (!request || !key || !value)
+		return;
+
+	if (request->shared && plist_dict_get_item(request->shared->request.fields, key)) {
+		if (idevice_activation_request_unshare(request) != IDEVICE_ACTIVATION_E_SUCCESS)
+			return;
+	}
+	idevice_activation_body_free(&request->body);
+	plist_dict_set_item(request->fields, key, plist_new_string(value));
+}
+
+void idevice_activation_request_get_field(idevice_activation_request_t request, const char* key, char** value)
+{
+	if (!request || !key || !value)
+		return;
+
+	char* tmp_value = NULL;
+
+	plist_t item = plist_dict_get_item(request->fields, key);
+	if (!item && request->shared) {
+		item = plist_dict_get_item(request->shared->request.fields, key);
+	}
+
+	if (item && plist_get_node_type(item) == PLIST_STRING) {
+		plist_get_string_val(item, &tmp_value);
+	} else if (item) {
+		struct idevice_activation_buffer buf = { NULL, 0, 0 };
+		if (idevice_activation_plist_write_xml(&buf, item, 0) == IDEVICE_ACTIVATION_E_SUCCESS) {
+			tmp_value = buf.data;
+		} else {
+			free(buf.data);
+		}
+	}
+
+	*value = tmp_value;
+}
+
+void idevice_activation_request_get_url(idevice_activation_request_t request, const char** url)
+{
+	if (!request || !url)
+		return;
+
+	*url = request->url;
+}
+
+void idevice_activation_request_set_url(idevice_activation_request_t request, const char* url)
+{
+	if (!request || !url)
+		return;
+
+	free(request->url);
+	request->url = strdup(url);
+}
+
+void idevice_activation_request_set_compression(idevice_activation_request_t request, int enable)
+{
+	if (!request)
+		return;
+
+	request->compression = (enable) ? 1 : 0;
+}
+
+void idevice_activation_request_set_streaming_parse(idevice_activation_request_t request, int enable)
+{
+	if (!request)
+		return;
+
+	request->streaming_parse = (enable) ? 1 : 0;
+}
+
+void idevice_activation_request_set_plist_format(idevice_activation_request_t request, idevice_activation_plist_format_t format)
+{
+	if (!request)
+		return;
+
+	if (request->plist_format != format) {
+		idevice_activation_body_free(&request->body);
+	}
+	request->plist_format = format;
+}
+
+void idevice_activation_request_set_lazy_parse(idevice_activation_request_t request, int enable)
+{
+	if (!request)
+		return;
+
+	request->lazy_parse = (enable) ? 1 : 0;
+}
+
+idevice_activation_error_t idevice_activation_request_serialize(idevice_activation_request_t request)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	struct idevice_activation_body* body = NULL;
+
+	if (!request)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	body = &request->body;
+	if (body->valid && body->content_type == request->content_type)
+		return IDEVICE_ACTIVATION_E_SUCCESS;
+
+	idevice_activation_body_free(body);
+
+	if (request->shared && request->shared->request.body.content_type != request->content_type) {
+		result = idevice_activation_request_unshare(request);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+			return result;
+	}
+	if (request->shared && request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST) {
+		// a plist document can not be continued, build it from all fields
+		result = idevice_activation_request_unshare(request);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+			return result;
+	}
+
+	if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA) {
+		plist_dict_iter iter = NULL;
+		char* key = NULL;
+		plist_t value_node = NULL;
+
+		if (request->shared) {
+			// the template parts go first and are not copied
+			const struct idevice_activation_body* shared_body = &request->shared->request.body;
+			unsigned int i;
+			for (i = 0; i < shared_body->num_parts; i++) {
+				struct idevice_activation_body_part* part = idevice_activation_body_next_part(body);
+				if (!part) {
+					idevice_activation_body_free(body);
+					return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+				}
+				*part = shared_body->parts[i];
+				part->borrowed = 1;
+				body->num_parts++;
+			}
+		}
+
+		plist_dict_new_iter(request->fields, &iter);
+		if (!iter) {
+			idevice_activation_body_free(body);
+			return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		}
+		do {
+			key = NULL;
+			value_node = NULL;
+			plist_dict_next_item(request->fields, iter, &key, &value_node);
+			if (key && value_node) {
+				result = idevice_activation_body_add_part(body, key, value_node);
+				if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+					free(key);
+					break;
+				}
+			} else {
+				free(key);
+			}
+		} while (value_node != NULL);
+		free(iter);
+	} else if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED) {
+		if (request->shared) {
+			const struct idevice_activation_body* shared_body = &request->shared->request.body;
+			result = idevice_activation_build_urlencoded_body(shared_body->data, shared_body->size, request->fields, &body->data, &body->size);
+		} else {
+			result = idevice_activation_build_urlencoded_body(NULL, 0, request->fields, &body->data, &body->size);
+		}
+	} else if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST) {
+		uint32_t size = 0;
+		if (request->plist_format == IDEVICE_ACTIVATION_PLIST_FORMAT_BINARY) {
+			plist_to_bin(request->fields, &body->data, &size);
+		} else {
+			plist_to_xml(request->fields, &body->data, &size);
+		}
+		body->size = size;
+		if (!body->data) {
+			result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		}
+	} else {
+		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	}
+
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		idevice_activation_body_free(body);
+		return result;
+	}
+
+	body->content_type = request->content_type;
+	body->valid = 1;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+void idevice_activation_request_set_timeouts(idevice_activation_request_t request, long connect_timeout_ms, long timeout_ms)
+{
+	if (!request)
+		return;
+
+	request->connect_timeout_ms = (connect_timeout_ms > 0) ? connect_timeout_ms : 0;
+	request->timeout_ms = (timeout_ms > 0) ? timeout_ms : 0;
+}
+
+void idevice_activation_request_set_low_speed_limit(idevice_activation_request_t request, long bytes_per_second, long seconds)
+{
+	if (!request)
+		return;
+
+	if (bytes_per_second > 0 && seconds > 0) {
+		request->low_speed_limit = bytes_per_second;
+		request->low_speed_time = seconds;
+	} else {
+		request->low_speed_limit = 0;
+		request->low_speed_time = 0;
+	}
+}
+
+void idevice_activation_request_set_retry_policy(idevice_activation_request_t request, const idevice_activation_retry_policy_t* policy)
+{
+	if (!request)
+		return;
+
+	if (policy) {
+		request->retry_policy = *policy;
+	} else {
+		memset(&request->retry_policy, '\0', sizeof(request->retry_policy));
+	}
+}
+
+void idevice_activation_request_set_cancel(idevice_activation_request_t request, idevice_activation_cancel_t cancel)
+{
+	if (!request)
+		return;
+
+	request->cancel = cancel;
+}
+
+idevice_activation_error_t idevice_activation_cancel_new(idevice_activation_cancel_t* cancel)
+{
+	if (!cancel)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	idevice_activation_cancel_t tmp_cancel = (idevice_activation_cancel_t) malloc(sizeof(idevice_activation_cancel));
+
+	if (!tmp_cancel) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	idevice_activation_atomic_store(&tmp_cancel->cancelled, 0);
+	*cancel = tmp_cancel;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+void idevice_activation_cancel_free(idevice_activation_cancel_t cancel)
+{
+	free(cancel);
+}
+
+void idevice_activation_cancel_trigger(idevice_activation_cancel_t cancel)
+{
+	if (!cancel)
+		return;
+
+	idevice_activation_atomic_store(&cancel->cancelled, 1);
+}
+
+void idevice_activation_cancel_reset(idevice_activation_cancel_t cancel)
+{
+	if (!cancel)
+		return;
+
+	idevice_activation_atomic_store(&cancel->cancelled, 0);
+}
+
+int idevice_activation_cancel_is_triggered(idevice_activation_cancel_t cancel)
+{
+	if (!cancel)
+		return 0;
+
+	return (idevice_activation_atomic_load(&cancel->cancelled)) ? 1 : 0;
+}
+
+idevice_activation_error_t idevice_activation_response_new(idevice_activation_response_t* response)
+{
+	if (!response)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	idevice_activation_response_t tmp_response = (idevice_activation_response_t) malloc(sizeof(idevice_activation_response));
+
+	if (!tmp_response) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	tmp_response->raw_content = NULL;
+	tmp_response->raw_content_size = 0;
+	tmp_response->raw_content_capacity = 0;
+	tmp_response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_UNKNOWN;
+	tmp_response->title = NULL;
+	tmp_response->description = NULL;
+	tmp_response->activation_record = NULL;
+	tmp_response->header_list = NULL;
+	tmp_response->headers_tail = &tmp_response->header_list;
+	tmp_response->content_length = 0;
+	tmp_response->retry_after = NULL;
+	tmp_response->location = NULL;
+	tmp_response->headers = NULL;
+	tmp_response->fields = plist_new_dict();
+	tmp_response->fields_require_input = plist_new_dict();
+	tmp_response->fields_secure_input = plist_new_dict();
+	tmp_response->labels = plist_new_dict();
+	tmp_response->labels_placeholder = plist_new_dict();
+	tmp_response->http_status = 0;
+	memset(&tmp_response->timings, '\0', sizeof(tmp_response->timings));
+	tmp_response->streaming_parse = 0;
+	tmp_response->parse_pending = 0;
+	tmp_response->parse_result = IDEVICE_ACTIVATION_E_SUCCESS;
+	tmp_response->push_parser = NULL;
+	tmp_response->doc = NULL;
+	tmp_response->is_activation_ack = 0;
+	tmp_response->is_auth_required = 0;
+	tmp_response->has_errors = 0;
+	tmp_response->arena.blocks = NULL;
+	*response = tmp_response;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+idevice_activation_error_t idevice_activation_response_new_from_html(const char* content, idevice_activation_response_t* response)
+{
+	if (!content || !response)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	idevice_activation_response_t tmp_response = NULL;
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+
+	result = idevice_activation_response_new(&tmp_response);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		return result;
+	}
+
+	const size_t tmp_size = strlen(content);
+	char* tmp_content = (char*) malloc(sizeof(char) * tmp_size);
+
+	if (!tmp_content) {
+		idevice_activation_response_free(tmp_response);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	memcpy(tmp_content, content, tmp_size);
+
+	tmp_response->raw_content = tmp_content;
+	tmp_response->raw_content_size = tmp_size;
+	tmp_response->raw_content_capacity = tmp_size;
+	tmp_response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_HTML;
+
+	result = idevice_activation_parse_html_response(tmp_response);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		idevice_activation_response_free(tmp_response);
+		return result;
+	}
+
+	*response = tmp_response;
+
+	return result;
+}
+
+idevice_activation_error_t idevice_activation_response_to_buffer(idevice_activation_response_t response, char** buffer, size_t* size)
+{
+	if (!response || !buffer || !size)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	char* tmp_buffer = (char*) malloc(sizeof(char) * response->raw_content_size);
+	if (!tmp_buffer) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+
+	memcpy(tmp_buffer, response->raw_content, response->raw_content_size);
+
+	*buffer = tmp_buffer;
+	*size = response->raw_content_size;
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
+
+void idevice_activation_response_free(idevice_activation_response_t response)
+{
+	if (!response)
+		return;
+
+	if (response->push_parser) {
+		xmlFreeDoc(response->push_parser->myDoc);
+		xmlFreeParserCtxt(response->push_parser);
+	}
+	xmlFreeDoc(response->doc);
+	free(response->raw_content);
+	idevice_activation_arena_free(&response->arena);
+	plist_free(response->activation_record);
+	plist_free(response->headers);
+	plist_free(response->fields);
+	plist_free(response->fields_require_input);
+	plist_free(response->fields_secure_input);
+	plist_free(response->labels);
+	plist_free(response->labels_placeholder);
+	free(response);
+}
+
+idevice_activation_error_t idevice_activation_response_parse(idevice_activation_response_t response)
+{
+	if (!response)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	idevice_activation_response_ensure_parsed(response);
+
+	return response->parse_result;
+}
+
+void idevice_activation_response_get_field(idevice_activation_response_t response, const char* key, char** value)
+{
+	if (!response || !key || !value)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	*value = NULL;
+	plist_t item = plist_dict_get_item(response->fields, key);
+
+	if (item && plist_get_node_type(item) == PLIST_STRING) {
+		plist_get_string_val(item, value);
+	}
+}
+
+void idevice_activation_response_get_fields(idevice_activation_response_t response, plist_t* fields)
+{
+	if (!response || !fields)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	if (response->fields) {
+		*fields = plist_copy(response->fields);
+	}
+}
+
+void idevice_activation_response_get_label(idevice_activation_response_t response, const char* key, char** value)
+{
+	if (!response || !key || !value)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	*value = NULL;
+	plist_t item = plist_dict_get_item(response->labels, key);
+	if (item) {
+		plist_get_string_val(item, value);
+	}
+}
+
+void idevice_activation_response_get_placeholder(idevice_activation_response_t response, const char* key, char** value)
+{
+	if (!response || !key || !value)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	*value = NULL;
+	plist_t item = plist_dict_get_item(response->labels_placeholder, key);
+	if (item) {
+		plist_get_string_val(item, value);
+	}
+}
+
+void idevice_activation_response_get_title(idevice_activation_response_t response, const char** title)
+{
+	if (!response || !title)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	*title = response->title;
+}
+
+void idevice_activation_response_get_description(idevice_activation_response_t response, const char** description)
+{
+	if (!response || !description)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	*description = response->description;
+}
+
+void idevice_activation_response_get_activation_record(idevice_activation_response_t response, plist_t* activation_record)
+{
+	if (!response || !activation_record)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	if (response->activation_record) {
+		*activation_record = plist_copy(response->activation_record);
+	} else {
+		*activation_record = NULL;
+	}
+}
+
+void idevice_activation_response_take_activation_record(idevice_activation_response_t response, plist_t* activation_record)
+{
+	if (!response || !activation_record)
+		return;
+
+	idevice_activation_response_ensure_parsed(response);
+	// hand over the node itself, the response no longer refers to it
+	*activation_record = response->activation_record;
+	response->activation_record = NULL;
+}
+
+plist_t idevice_activation_response_borrow_activation_record(idevice_activation_response_t response)
+{
+	if (!response)
+		return NULL;
+
+	idevice_activation_response_ensure_parsed(response);
+	return response->activation_record;
+}
+
+void idevice_activation_response_get_headers(idevice_activation_response_t response, plist_t* headers)
+{
+	if (!response || !headers)
+		return;
+
+	// the dict is only needed by few callers, build it on first use
+	if (!response->headers) {
+		struct idevice_activation_header* header = NULL;
+		response->headers = plist_new_dict();
+		for (header = response->header_list; header; header = header->next) {
+			plist_dict_set_item(response->headers, header->name, plist_new_string(header->value));
+		}
+	}
+
+	*headers = plist_copy(response->headers);
+}
+
+void idevice_activation_response_get_header(idevice_activation_response_t response, const char* name, const char** value)
+{
+	struct idevice_activation_header* header = NULL;
+
+	if (!response || !name || !value)
+		return;
+
+	*value = NULL;
+	for (header = response->header_list; header; header = header->next) {
+		// the last one wins, like it does in the dict of all headers
+		if (strcasecmp(header->name, name) == 0) {
+			*value = header->value;
+		}
+	}
+}
+
+void idevice_activation_response_get_content_length(idevice_activation_response_t response, uint64_t* length)
+{
+	if (!response || !length)
+		return;
+
+	*length = (uint64_t)response->content_length;
+}
+
+void idevice_activation_response_get_location(idevice_activation_response_t response, const char** location)
+{
+	if (!response || !location)
+		return;
+
+	*location = response->location;
+}
+
+void idevice_activation_response_get_timings(idevice_activation_response_t response, idevice_activation_timings_t* timings)
+{
+	if (!response || !timings)
+		return;
+
+	*timings = response->timings;
+}
+
+int idevice_activation_response_is_activation_acknowledged(idevice_activation_response_t response)
+{
+	if (!response)
+		return 0;
+
+	idevice_activation_response_ensure_parsed(response);
+	return response->is_activation_ack;
+}
+
+int idevice_activation_response_is_authentication_required(idevice_activation_response_t response)
+{
+	if (!response)
+		return 0;
+
+	idevice_activation_response_ensure_parsed(response);
+	return response->is_auth_required;
+}
+
+int idevice_activation_response_field_requires_input(idevice_activation_response_t response, const char* key)
+{
+	if (!response || !key)
+		return 0;
+
+	idevice_activation_response_ensure_parsed(response);
+	return (plist_dict_get_item(response->fields_require_input, key) ? 1 : 0);
+}
 
-			if (plist == NULL) {
-				return IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
-			}
+int idevice_activation_response_field_secure_input(idevice_activation_response_t response, const char* key)
+{
+	if (!response || !key)
+		return 0;
 
-			/* check if this is a reply to drmHandshake request */
-			if (plist_dict_get_item(plist, "HandshakeResponseMessage") != NULL) {
-				result = IDEVICE_ACTIVATION_E_SUCCESS;
-			} else {
-				result = idevice_activation_activation_record_from_plist(response, plist);
-			}
+	idevice_activation_response_ensure_parsed(response);
+	return (plist_dict_get_item(response->fields_secure_input, key) ? 1 : 0);
+}
 
-			plist_free(response->fields);
-			response->fields = plist;
+int idevice_activation_response_has_errors(idevice_activation_response_t response)
+{
+	if (!response)
+		return 0;
 
-			return result;
-		}
-		case IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML:
-			return idevice_activation_parse_buddyml_response(response);
-		case IDEVICE_ACTIVATION_CONTENT_TYPE_HTML:
-			return idevice_activation_parse_html_response(response);
-		default:
-			return IDEVICE_ACTIVATION_E_UNKNOWN_CONTENT_TYPE;
-	}
+	idevice_activation_response_ensure_parsed(response);
+	return response->has_errors;
+}
 
-	return IDEVICE_ACTIVATION_E_SUCCESS;
+static void idevice_activation_sleep_ms(unsigned int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+#endif
 }
 
-static size_t idevice_activation_write_callback(char* data, size_t size, size_t nmemb, void* userdata)
+static uint32_t idevice_activation_random(void)
 {
-	idevice_activation_response_t response = (idevice_activation_response_t)userdata;
-	const size_t total = size * nmemb;
+	// splitmix64 over the clock and a stack address, good enough for
+	// jitter and free of shared state between threads
+	uint64_t x = idevice_activation_get_time_ms();
+	x ^= (uint64_t)(uintptr_t)&x;
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (uint32_t)x;
+}
 
-	if (total != 0) {
-		response->raw_content = realloc(response->raw_content, response->raw_content_size + total + 1);
-		memcpy(response->raw_content + response->raw_content_size, data, total);
-		response->raw_content[response->raw_content_size + total] = '\0';
-		response->raw_content_size += total;
+static int idevice_activation_response_get_retry_after(idevice_activation_response_t response, uint64_t* delay_ms)
+{
+	const char* value = response->retry_after;
+	char* end = NULL;
+	unsigned long seconds = 0;
+
+	if (!value)
+		return 0;
+
+	seconds = strtoul(value, &end, 10);
+	if (end != value && *end == '\0') {
+		// delay-seconds
+		*delay_ms = (uint64_t)seconds * 1000;
+		return 1;
 	}
 
-	return total;
+	// HTTP-date
+	time_t when = curl_getdate(value, NULL);
+	if (when != (time_t)-1) {
+		time_t now = time(NULL);
+		*delay_ms = (when > now) ? (uint64_t)(when - now) * 1000 : 0;
+		return 1;
+	}
+
+	return 0;
 }
 
-static size_t idevice_activation_header_callback(void *data, size_t size, size_t nmemb, void *userdata)
+static void idevice_activation_transfer_collect_info(struct idevice_activation_transfer* transfer)
 {
-	idevice_activation_response_t response = (idevice_activation_response_t)userdata;
-	const size_t total = size * nmemb;
-	if (total != 0) {
-		char *header = malloc(total + 1);
-		char *value = NULL;
-		char *p = NULL;
-		memcpy(header, data, total);
-		header[total] = '\0';
-
-		p = strchr(header, ':');
-		if (p) {
-			*p = '\0';
-			p++;
-			while (*p == ' ') {
-				p++;
-			}
-			if (*p != '\0') {
-				value = p;
-				while (*p != '\0' && *p != '\n' && *p != '\r') {
-					p++;
-				}
-				*p = '\0';
-			}
-		}
-		if (value) {
-			if (strncasecmp(header, "Content-Type", 12) == 0) {
-				if (strncasecmp(value, "text/xml", 8) == 0) {
-					response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
-				} else if (strncasecmp(value, "application/xml", 15) == 0) {
-					response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
-				} else if (strncasecmp(value, "application/x-buddyml", 21) == 0) {
-					response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML;
-				} else if (strncasecmp(value, "text/html", 9) == 0) {
-					response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_HTML;
+	idevice_activation_timings_t* timings = &transfer->response->timings;
+	CURL* handle = transfer->handle;
+
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &transfer->response->http_status);
+
+	if (debug_level > 0)
+		fprintf(stderr, "%s: received %zu bytes into a buffer of %zu bytes\n", __func__, transfer->response->raw_content_size, transfer->response->raw_content_capacity);
+
+	curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME, &timings->namelookup);
+	curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME, &timings->connect);
+	curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME, &timings->appconnect);
+	curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME, &timings->pretransfer);
+	curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &timings->starttransfer);
+	curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &timings->total);
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t bytes = 0;
+	curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &bytes);
+	timings->bytes_uploaded = (uint64_t)bytes;
+	bytes = 0;
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	timings->bytes_downloaded = (uint64_t)bytes;
+#else
+	double bytes = 0;
+	curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD, &bytes);
+	timings->bytes_uploaded = (uint64_t)bytes;
+	bytes = 0;
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &bytes);
+	timings->bytes_downloaded = (uint64_t)bytes;
+#endif
+}
+
+// longest Retry-After honoured when the retry policy sets no limit
+#define IDEVICE_ACTIVATION_RETRY_AFTER_MAX_MS (5 * 60 * 1000)
+
+static int idevice_activation_transfer_should_retry(struct idevice_activation_transfer* transfer, CURLcode code, unsigned int* delay_ms)
+{
+	const idevice_activation_retry_policy_t* policy = &transfer->request->retry_policy;
+	unsigned int retry_class = 0;
+	uint64_t retry_after = 0;
+	uint64_t retry_after_max = IDEVICE_ACTIVATION_RETRY_AFTER_MAX_MS;
+	int has_retry_after = 0;
+	long status = 0;
+
+	status = transfer->response->http_status;
+	transfer->attempt++;
+
+	if (transfer->attempt >= policy->max_attempts)
+		return 0;
+
+	has_retry_after = idevice_activation_response_get_retry_after(transfer->response, &retry_after);
+
+	switch (code) {
+		case CURLE_OK:
+			if (status >= 500 || status == 429) {
+				retry_class = IDEVICE_ACTIVATION_RETRY_ON_SERVER_ERROR;
+				if ((status == 503 || status == 429) && has_retry_after) {
+					retry_class |= IDEVICE_ACTIVATION_RETRY_ON_RETRY_AFTER;
 				}
+			} else if (transfer->response->raw_content_size == 0) {
+				retry_class = IDEVICE_ACTIVATION_RETRY_ON_EMPTY_RESPONSE;
 			}
-			plist_dict_set_item(response->headers, header, plist_new_string(value));
-		}
-		free(header);
+			break;
+		case CURLE_OPERATION_TIMEDOUT:
+			retry_class = IDEVICE_ACTIVATION_RETRY_ON_TIMEOUT;
+			break;
+		case CURLE_ABORTED_BY_CALLBACK:
+		case CURLE_OUT_OF_MEMORY:
+			return 0;
+		case CURLE_COULDNT_RESOLVE_PROXY:
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+			// nothing was sent yet
+			retry_class = IDEVICE_ACTIVATION_RETRY_ON_CONNECTION_ERROR | IDEVICE_ACTIVATION_RETRY_ON_CONNECT_FAILURE;
+			break;
+		default:
+			retry_class = IDEVICE_ACTIVATION_RETRY_ON_CONNECTION_ERROR;
+			break;
 	}
-	return total;
-}
 
-static char* urlencode(const char* buf)
-{
-	static const signed char conv_table[256] = {
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
-		1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
-		1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
-	};
+	if (!(policy->retry_on & retry_class))
+		return 0;
 
+	// exponential backoff with full jitter
+	uint64_t backoff = policy->base_backoff_ms;
 	unsigned int i;
-	int count = 0;
-	for (i = 0; i < strlen(buf); i++) {
-		if (conv_table[(int)buf[i]]) {
-			count++;
-		}
-	}
-	int newsize = strlen(buf) + count*2 + 1;
-	char* res = malloc(newsize);
-	int o = 0;
-	for (i = 0; i < strlen(buf); i++) {
-		if (conv_table[(int)buf[i]]) {
-			sprintf(&res[o], "%%%02X", (unsigned char)buf[i]);
-			o+=3;
-		} else {
-			res[o] = buf[i];
-			o++;
+	for (i = 1; i < transfer->attempt && backoff < 0x80000000ULL; i++) {
+		backoff <<= 1;
+	}
+	if (policy->max_backoff_ms > 0 && backoff > policy->max_backoff_ms) {
+		backoff = policy->max_backoff_ms;
+	}
+	uint64_t delay = (backoff > 0) ? idevice_activation_random() % (backoff + 1) : 0;
+
+	// the server knows best when it wants to see us again
+	if (has_retry_after) {
+		if (policy->max_backoff_ms > 0) {
+			retry_after_max = policy->max_backoff_ms;
+		}
+		if (retry_after > retry_after_max) {
+			if (debug_level > 0)
+				fprintf(stderr, "%s: Retry-After of %llu ms is longer than allowed\n", __func__, (unsigned long long)retry_after);
+			return 0;
+		}
+		if (retry_after > delay) {
+			delay = retry_after;
 		}
 	}
-	res[o] = '\0';
 
-	return res;
+	if (debug_level > 0)
+		fprintf(stderr, "%s: attempt %u of %u failed, retrying in %llu ms\n", __func__, transfer->attempt, policy->max_attempts, (unsigned long long)delay);
+
+	*delay_ms = (unsigned int)delay;
+
+	return 1;
 }
 
-static int plist_strip_xml(char** xmlplist)
+static void idevice_activation_transfer_cleanup(struct idevice_activation_transfer* transfer)
 {
-	if (!xmlplist || !*xmlplist)
-		return -1;
-
-	char* start = strstr(*xmlplist, "<plist version=\"1.0\">\n");
-	if (!start)
-		return -1;
+#ifdef IDEVICE_ACTIVATION_USE_MIME
+	if (transfer->mime) {
+		curl_mime_free(transfer->mime);
+		transfer->mime = NULL;
+	}
+#else
+	if (transfer->form) {
+		curl_formfree(transfer->form);
+		transfer->form = NULL;
+	}
+#endif
+	if (transfer->slist) {
+		curl_slist_free_all(transfer->slist);
+		transfer->slist = NULL;
+	}
+	if (transfer->response) {
+		idevice_activation_response_free(transfer->response);
+		transfer->response = NULL;
+	}
+}
 
-	char* stop = strstr(*xmlplist, "\n</plist>");
-	if (!stop)
-		return -1;
+#ifdef IDEVICE_ACTIVATION_USE_MIME
+/* Read position of curl in a part of the cached request body, the
+ * value itself is never copied into the form. */
+struct idevice_activation_mime_part {
+	const char* data;
+	size_t size;
+	size_t pos;
+};
 
-	start += strlen("<plist version=\"1.0\">\n");
-	uint32_t size = stop - start;
-	char* stripped = malloc(size + 1);
-	if (!stripped)
-		return -1;
+static size_t idevice_activation_mime_part_read(char* buffer, size_t size, size_t nitems, void* arg)
+{
+	struct idevice_activation_mime_part* part = (struct idevice_activation_mime_part*) arg;
+	size_t len = size * nitems;
 
-	memcpy(stripped, start, size);
-	stripped[size] = '\0';
-	free(*xmlplist);
-	*xmlplist = stripped;
+	if (len > part->size - part->pos)
+		len = part->size - part->pos;
+	memcpy(buffer, part->data + part->pos, len);
+	part->pos += len;
 
-	return 0;
+	return len;
 }
 
-static int idevice_activation_curl_debug_callback(CURL *handle, curl_infotype type, char *data, size_t size, void *userptr)
+static int idevice_activation_mime_part_seek(void* arg, curl_off_t offset, int origin)
 {
-	switch (type) {
-	case CURLINFO_TEXT:
-		fprintf(stderr, "* ");
-		break;
-	case CURLINFO_DATA_IN:
-	case CURLINFO_HEADER_IN:
-		fprintf(stderr, "< ");
-		break;
-	case CURLINFO_DATA_OUT:
-	case CURLINFO_HEADER_OUT:
-		fprintf(stderr, "> ");
-		break;
-	case CURLINFO_SSL_DATA_IN:
-	case CURLINFO_SSL_DATA_OUT:
-		return 0;
-	default:
-		return 0;
-	}
+	struct idevice_activation_mime_part* part = (struct idevice_activation_mime_part*) arg;
+	curl_off_t pos = 0;
 
-	fwrite(data, 1, size, stderr);
-	if (size > 0 && data[size-1] != '\n') {
-		fprintf(stderr, "\n");
+	// needed to send the body again after a redirect
+	switch (origin) {
+		case SEEK_SET:
+			pos = offset;
+			break;
+		case SEEK_CUR:
+			pos = (curl_off_t)part->pos + offset;
+			break;
+		case SEEK_END:
+			pos = (curl_off_t)part->size + offset;
+			break;
+		default:
+			return CURL_SEEKFUNC_FAIL;
 	}
-	return 0;
+	if (pos < 0 || pos > (curl_off_t)part->size)
+		return CURL_SEEKFUNC_FAIL;
+
+	part->pos = (size_t)pos;
+
+	return CURL_SEEKFUNC_OK;
 }
 
-idevice_activation_error_t idevice_activation_request_new(idevice_activation_client_type_t client_type, idevice_activation_request_t* request)
+static void idevice_activation_mime_part_free(void* arg)
 {
-	if (!request)
-		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	free(arg);
+}
 
-	idevice_activation_request_t tmp_request = (idevice_activation_request_t) malloc(sizeof(idevice_activation_request));
+static idevice_activation_error_t idevice_activation_mime_add_part(curl_mime* mime, const struct idevice_activation_body_part* body_part)
+{
+	struct idevice_activation_mime_part* part = NULL;
+	curl_mimepart* mimepart = NULL;
 
-	if (!tmp_request) {
+	part = (struct idevice_activation_mime_part*) calloc(1, sizeof(struct idevice_activation_mime_part));
+	if (!part)
 		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
-	}
 
-	tmp_request->client_type = client_type;
-	tmp_request->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED;
-	tmp_request->url = strdup(IDEVICE_ACTIVATION_DEFAULT_URL);
-	tmp_request->fields = plist_new_dict();
-	*request = tmp_request;
+	part->data = body_part->data;
+	part->size = body_part->size;
+
+	mimepart = curl_mime_addpart(mime);
+	if (!mimepart) {
+		idevice_activation_mime_part_free(part);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
+	curl_mime_name(mimepart, body_part->name);
+	// from here on curl owns the part and releases it with the form
+	if (curl_mime_data_cb(mimepart, (curl_off_t)part->size, idevice_activation_mime_part_read, idevice_activation_mime_part_seek, idevice_activation_mime_part_free, part) != CURLE_OK) {
+		idevice_activation_mime_part_free(part);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
 
 	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
+#endif
 
-idevice_activation_error_t idevice_activation_request_new_from_lockdownd(idevice_activation_client_type_t client_type, lockdownd_client_t lockdown, idevice_activation_request** request)
+static idevice_activation_error_t idevice_activation_transfer_prepare(struct idevice_activation_transfer* transfer, idevice_activation_request_t request)
 {
-	if (!lockdown || !request) {
-		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
-	}
-
-	uint8_t has_telephony_capability = 0;
-	uint8_t has_mobile_equipment_id = 0;
-	lockdownd_error_t err;
-	plist_t info = NULL;
-	plist_t node = NULL;
-	plist_t fields = plist_new_dict();
-
-	// add InStoreActivation
-	plist_dict_set_item(fields, "InStoreActivation", plist_new_string("false"));
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	CURL* handle = transfer->handle;
 
-	// get a bunch of information at once
-	err = lockdownd_get_value(lockdown, NULL, NULL, &info);
-	if (err != LOCKDOWN_E_SUCCESS) {
-		if (debug_level > 0)
-			fprintf(stderr, "%s: Unable to get basic information from lockdownd\n", __func__);
-		plist_free(fields);
-		return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
-	}
+	transfer->request = request;
 
-	// add AppleSerialNumber
-	node = plist_dict_get_item(info, "SerialNumber");
-	if (!node || plist_get_node_type(node) != PLIST_STRING) {
-		if (debug_level > 0)
-			fprintf(stderr, "%s: Unable to get SerialNumber from lockdownd\n", __func__);
-		plist_free(fields);
-		plist_free(info);
-		return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+	result = idevice_activation_request_serialize(request);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		return result;
 	}
-	plist_dict_set_item(fields, "AppleSerialNumber", plist_copy(node));
-	node = NULL;
 
-
-	// check if device has telephone capability
-	node = plist_dict_get_item(info, "TelephonyCapability");
-	if (!node || plist_get_node_type(node) != PLIST_BOOLEAN) {
-		has_telephony_capability = 0;
-	} else {
-		plist_get_bool_val(node, &has_telephony_capability);
+	switch (request->client_type) {
+		case IDEVICE_ACTIVATION_CLIENT_MOBILE_ACTIVATION:
+			curl_easy_setopt(handle, CURLOPT_USERAGENT, IDEVICE_ACTIVATION_USER_AGENT_IOS);
+			break;
+		case IDEVICE_ACTIVATION_CLIENT_ITUNES:
+			curl_easy_setopt(handle, CURLOPT_USERAGENT, IDEVICE_ACTIVATION_USER_AGENT_ITUNES);
+			break;
+		default:
+			result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+			goto cleanup;
 	}
-	node = NULL;
 
-	if (has_telephony_capability) {
-		// add IMEI
-		node = plist_dict_get_item(info, "InternationalMobileEquipmentIdentity");
-		if (!node || plist_get_node_type(node) != PLIST_STRING) {
-			has_mobile_equipment_id = 0;
-		} else {
-			plist_dict_set_item(fields, "IMEI", plist_copy(node));
-			has_mobile_equipment_id = 1;
+	// the body lives in the request cache and is not copied, see
+	// idevice_activation_request_serialize()
+	if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA) {
+		unsigned int i;
+#ifdef IDEVICE_ACTIVATION_USE_MIME
+		transfer->mime = curl_mime_init(handle);
+		if (!transfer->mime) {
+			result = IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+			goto cleanup;
 		}
-		node = NULL;
-
-		// add MEID
-		node = plist_dict_get_item(info, "MobileEquipmentIdentifier");
-		if (!node || plist_get_node_type(node) != PLIST_STRING) {
-			if (debug_level > 0)
-				fprintf(stderr, "%s: Unable to get MEID from lockdownd\n", __func__);
-			if (!has_mobile_equipment_id) {
-				plist_free(fields);
-				plist_free(info);
-				return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+		for (i = 0; i < request->body.num_parts; i++) {
+			result = idevice_activation_mime_add_part(transfer->mime, &request->body.parts[i]);
+			if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+				goto cleanup;
 			}
-		} else {
-			plist_dict_set_item(fields, "MEID", plist_copy(node));
 		}
-		node = NULL;
-
-		// add IMSI
-		node = plist_dict_get_item(info, "InternationalMobileSubscriberIdentity");
-		if (!node || plist_get_node_type(node) != PLIST_STRING) {
-			if (debug_level > 0)
-				fprintf(stderr, "%s: Unable to get IMSI from lockdownd\n", __func__);
-		} else {
-			plist_dict_set_item(fields, "IMSI", plist_copy(node));
+		curl_easy_setopt(handle, CURLOPT_MIMEPOST, transfer->mime);
+#else
+		struct curl_httppost* last = NULL;
+		for (i = 0; i < request->body.num_parts; i++) {
+			const struct idevice_activation_body_part* part = &request->body.parts[i];
+			curl_formadd(&transfer->form, &last, CURLFORM_COPYNAME, part->name, CURLFORM_PTRCONTENTS, part->data, CURLFORM_CONTENTSLENGTH, (long)part->size, CURLFORM_END);
 		}
-		node = NULL;
+		curl_easy_setopt(handle, CURLOPT_HTTPPOST, transfer->form);
+#endif
 
-		// add ICCID
-		node = plist_dict_get_item(info, "IntegratedCircuitCardIdentity");
-		if (!node || plist_get_node_type(node) != PLIST_STRING) {
-			if (debug_level > 0)
-				fprintf(stderr, "%s: Unable to get ICCID from lockdownd\n", __func__);
+	} else if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED) {
+		curl_easy_setopt(handle, CURLOPT_POST, 1);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request->body.data);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long)request->body.size);
+	} else if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST) {
+		curl_easy_setopt(handle, CURLOPT_POST, 1);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request->body.data);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long)request->body.size);
+		if (request->plist_format == IDEVICE_ACTIVATION_PLIST_FORMAT_BINARY) {
+			// servers that only know XML are still free to answer with it
+			transfer->slist = curl_slist_append(NULL, "Content-Type: application/x-bplist");
+			transfer->slist = curl_slist_append(transfer->slist, "Accept: application/x-bplist, application/xml;q=0.9");
 		} else {
-			plist_dict_set_item(fields, "ICCID", plist_copy(node));
+			transfer->slist = curl_slist_append(NULL, "Content-Type: application/x-apple-plist");
+			transfer->slist = curl_slist_append(transfer->slist, "Accept: application/xml");
 		}
-		node = NULL;
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, transfer->slist);
+	}
+	else {
+		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		goto cleanup;
 	}
-	plist_free(info);
-	info = NULL;
 
-	// add activation-info
-	err = lockdownd_get_value(lockdown, NULL, "ActivationInfo", &node);
-	if (err != LOCKDOWN_E_SUCCESS || !node || plist_get_node_type(node) != PLIST_DICT) {
-		fprintf(stderr, "%s: Unable to get ActivationInfo from lockdownd\n", __func__);
-		plist_free(fields);
-		return IDEVICE_ACTIVATION_E_INCOMPLETE_INFO;
+	result = idevice_activation_response_new(&transfer->response);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		goto cleanup;
 	}
-	plist_dict_set_item(fields, "activation-info", plist_copy(node));
-	plist_free(node);
-	node = NULL;
+	transfer->response->streaming_parse = request->streaming_parse;
 
-	idevice_activation_request* tmp_request = (idevice_activation_request*) malloc(sizeof(idevice_activation_request));
+	if (shared_cache) {
+		curl_easy_setopt(handle, CURLOPT_SHARE, shared_cache);
+	}
+	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, transfer->response);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &idevice_activation_write_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, transfer->response);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &idevice_activation_header_callback);
+	curl_easy_setopt(handle, CURLOPT_URL, request->url);
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
 
-	if (!tmp_request) {
-		plist_free(fields);
-		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	if (request->compression) {
+		// an empty string offers every encoding libcurl can decode
+		// (gzip, deflate and br if available), the body is decoded
+		// before it reaches the write callback
+#if LIBCURL_VERSION_NUM >= 0x071506
+		curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+#else
+		curl_easy_setopt(handle, CURLOPT_ENCODING, "");
+#endif
 	}
 
-	tmp_request->client_type = client_type;
-	tmp_request->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA;
-	tmp_request->url = strdup(IDEVICE_ACTIVATION_DEFAULT_URL);
-	tmp_request->fields = fields;
-	*request = tmp_request;
+	if (request->connect_timeout_ms > 0) {
+		curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, request->connect_timeout_ms);
+	}
+	if (request->timeout_ms > 0) {
+		curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, request->timeout_ms);
+	}
+	if (request->low_speed_limit > 0) {
+		curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, request->low_speed_limit);
+		curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, request->low_speed_time);
+	}
+	if (request->cancel) {
+#if LIBCURL_VERSION_NUM >= 0x072000
+		curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, idevice_activation_progress_callback);
+		curl_easy_setopt(handle, CURLOPT_XFERINFODATA, request->cancel);
+#else
+		curl_easy_setopt(handle, CURLOPT_PROGRESSFUNCTION, idevice_activation_progress_callback);
+		curl_easy_setopt(handle, CURLOPT_PROGRESSDATA, request->cancel);
+#endif
+		curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+	}
 
-	return IDEVICE_ACTIVATION_E_SUCCESS;
+	// enable communication debugging
+	if (debug_level > 0) {
+		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
+		curl_easy_setopt(handle, CURLOPT_DEBUGFUNCTION, idevice_activation_curl_debug_callback);
+	}
+
+cleanup:
+
+	return result;
 }
 
-idevice_activation_error_t idevice_activation_drm_handshake_request_new(idevice_activation_client_type_t client_type, idevice_activation_request_t* request)
+static idevice_activation_error_t idevice_activation_transfer_rearm(struct idevice_activation_transfer* transfer)
 {
-	if (!request)
-		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
 
-	idevice_activation_request_t tmp_request = (idevice_activation_request_t) malloc(sizeof(idevice_activation_request));
+	// the serialized body stays attached to the handle, only the
+	// response has to start over
+	idevice_activation_response_free(transfer->response);
+	transfer->response = NULL;
 
-	if (!tmp_request) {
-		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	result = idevice_activation_response_new(&transfer->response);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		return result;
 	}
+	transfer->response->streaming_parse = transfer->request->streaming_parse;
 
-	tmp_request->client_type = client_type;
-	tmp_request->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST;
-	tmp_request->url = strdup(IDEVICE_ACTIVATION_DRM_HANDSHAKE_DEFAULT_URL);
-	tmp_request->fields = plist_new_dict();
-	*request = tmp_request;
+	curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, transfer->response);
+	curl_easy_setopt(transfer->handle, CURLOPT_HEADERDATA, transfer->response);
 
 	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
 
-void idevice_activation_request_free(idevice_activation_request_t request)
+static idevice_activation_error_t idevice_activation_send_request_with_handle(CURL* handle, idevice_activation_request_t request, idevice_activation_response_t* response)
 {
-	if (!request)
-		return;
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	struct idevice_activation_transfer transfer;
 
-	plist_free(request->fields);
-	free(request);
-}
+	memset(&transfer, '\0', sizeof(transfer));
+	transfer.handle = handle;
 
-void idevice_activation_request_get_fields(idevice_activation_request_t request, plist_t* fields)
-{
-	if (!request || !fields)
-		return;
+	result = idevice_activation_transfer_prepare(&transfer, request);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		goto cleanup;
+	}
 
-	*fields = plist_copy(request->fields);
-}
+	CURLcode code = CURLE_OK;
+	while (1) {
+		unsigned int delay_ms = 0;
 
-void idevice_activation_request_set_fields(idevice_activation_request_t request, plist_t fields)
-{
-	if (!request || !fields)
-		return;
+		if (idevice_activation_cancel_is_triggered(request->cancel)) {
+			result = IDEVICE_ACTIVATION_E_CANCELLED;
+			goto cleanup;
+		}
 
-	if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED) {
-		// if at least one of the new fields has a different type than string, we have to change the type
-		plist_dict_iter iter = NULL;
-		plist_dict_new_iter(fields, &iter);
-		plist_t item = NULL;
-		do {
-			plist_dict_next_item(fields, iter, NULL, &item);
-			if (item && plist_get_node_type(item) != PLIST_STRING) {
-				request->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA;
-				break;
-			}
-		} while(item);
-	}
+		code = curl_easy_perform(handle);
+		idevice_activation_transfer_collect_info(&transfer);
+		if (!idevice_activation_transfer_should_retry(&transfer, code, &delay_ms)) {
+			break;
+		}
 
-	plist_dict_merge(&request->fields, fields);
-}
+		// sleep in slices to notice a cancellation in time
+		while (delay_ms > 0 && !idevice_activation_cancel_is_triggered(request->cancel)) {
+			unsigned int slice = (delay_ms > 50) ? 50 : delay_ms;
+			idevice_activation_sleep_ms(slice);
+			delay_ms -= slice;
+		}
 
-void idevice_activation_request_set_fields_from_response(idevice_activation_request_t request, const idevice_activation_response_t response)
-{
-	if (!request || !response)
-		return;
+		result = idevice_activation_transfer_rearm(&transfer);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+			goto cleanup;
+		}
+	}
 
-	plist_t response_fields = NULL;
-	idevice_activation_response_get_fields(response, &response_fields);
-	if (response_fields) {
-		idevice_activation_request_set_fields(request, response_fields);
-		free(response_fields);
+	if (code != CURLE_OK) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: %s\n", __func__, curl_easy_strerror(code));
+		result = idevice_activation_error_from_curl(code);
+		goto cleanup;
 	}
-}
 
-void idevice_activation_request_set_field(idevice_activation_request_t request, const char* key, const char* value)
-{
-	if (!request || !key || !value)
-		return;
+	if (request->lazy_parse) {
+		transfer.response->parse_pending = 1;
+	} else {
+		result = idevice_activation_parse_raw_response(transfer.response);
+		if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+			goto cleanup;
+		}
+	}
 
-	plist_dict_set_item(request->fields, key, plist_new_string(value));
-}
+	*response = transfer.response;
+	transfer.response = NULL;
 
-void idevice_activation_request_get_field(idevice_activation_request_t request, const char* key, char** value)
-{
-	if (!request || !key || !value)
-		return;
+cleanup:
+	idevice_activation_transfer_cleanup(&transfer);
 
-	char* tmp_value = NULL;
+	return result;
+}
 
-	plist_t item = plist_dict_get_item(request->fields, key);
+idevice_activation_error_t idevice_activation_send_request(idevice_activation_request_t request, idevice_activation_response_t* response)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
 
-	if (item && plist_get_node_type(item) == PLIST_STRING) {
-		plist_get_string_val(item, &tmp_value);
-	} else {
-		uint32_t data_size = 0;
-		plist_to_xml(item, &tmp_value, &data_size);
-		plist_strip_xml(&tmp_value);
+	// check arguments
+	if (!request || !response) {
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 	}
 
-	*value = tmp_value;
-}
+	CURL* handle = curl_easy_init();
+	if (!handle) {
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	}
 
-void idevice_activation_request_get_url(idevice_activation_request_t request, const char** url)
-{
-	if (!request || !url)
-		return;
+	// one-shot requests don't keep the connection around
+	curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1);
 
-	*url = request->url;
-}
+	result = idevice_activation_send_request_with_handle(handle, request, response);
 
-void idevice_activation_request_set_url(idevice_activation_request_t request, const char* url)
-{
-	if (!request || !url)
-		return;
+	curl_easy_cleanup(handle);
 
-	free(request->url);
-	request->url = strdup(url);
+	return result;
 }
 
-idevice_activation_error_t idevice_activation_response_new(idevice_activation_response_t* response)
+idevice_activation_error_t idevice_activation_session_new(idevice_activation_session_t* session)
 {
-	if (!response)
+	if (!session)
 		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-	idevice_activation_response_t tmp_response = (idevice_activation_response_t) malloc(sizeof(idevice_activation_response));
+	idevice_activation_session_t tmp_session = (idevice_activation_session_t) malloc(sizeof(idevice_activation_session));
 
-	if (!tmp_response) {
+	if (!tmp_session) {
 		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
 	}
 
-	tmp_response->raw_content = NULL;
-	tmp_response->raw_content_size = 0;
-	tmp_response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_UNKNOWN;
-	tmp_response->title = NULL;
-	tmp_response->description = NULL;
-	tmp_response->activation_record = NULL;
-	tmp_response->headers = plist_new_dict();
-	tmp_response->fields = plist_new_dict();
-	tmp_response->fields_require_input = plist_new_dict();
-	tmp_response->fields_secure_input = plist_new_dict();
-	tmp_response->labels = plist_new_dict();
-	tmp_response->labels_placeholder = plist_new_dict();
-	tmp_response->is_activation_ack = 0;
-	tmp_response->is_auth_required = 0;
-	tmp_response->has_errors = 0;
-	*response = tmp_response;
+	tmp_session->handle = curl_easy_init();
+	if (!tmp_session->handle) {
+		free(tmp_session);
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	}
+	*session = tmp_session;
 
 	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
 
-idevice_activation_error_t idevice_activation_response_new_from_html(const char* content, idevice_activation_response_t* response)
+void idevice_activation_session_free(idevice_activation_session_t session)
 {
-	if (!content || !response)
-		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	if (!session)
+		return;
 
-	idevice_activation_response_t tmp_response = NULL;
-	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	curl_easy_cleanup(session->handle);
+	free(session);
+}
 
-	result = idevice_activation_response_new(&tmp_response);
-	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
-		return result;
+idevice_activation_error_t idevice_activation_session_send_request(idevice_activation_session_t session, idevice_activation_request_t request, idevice_activation_response_t* response)
+{
+	// check arguments
+	if (!session || !request || !response) {
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 	}
 
-	const size_t tmp_size = strlen(content);
-	char* tmp_content = (char*) malloc(sizeof(char) * tmp_size);
+	// drop the options of the previous request but keep the connection,
+	// DNS and TLS session caches of the handle alive
+	curl_easy_reset(session->handle);
 
-	if (!tmp_content) {
-		idevice_activation_response_free(tmp_response);
-		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
-	}
+#if LIBCURL_VERSION_NUM >= 0x071900
+	// a buddyml round trip might wait on user input for a while
+	curl_easy_setopt(session->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
 
-	memcpy(tmp_content, content, tmp_size);
+	return idevice_activation_send_request_with_handle(session->handle, request, response);
+}
 
-	tmp_response->raw_content = tmp_content;
-	tmp_response->raw_content_size = tmp_size;
-	tmp_response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_HTML;
+idevice_activation_error_t idevice_activation_multi_new(idevice_activation_multi_t* multi)
+{
+	if (!multi)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-	result = idevice_activation_parse_html_response(tmp_response);
-	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
-		idevice_activation_response_free(tmp_response);
-		return result;
+	idevice_activation_multi_t tmp_multi = (idevice_activation_multi_t) malloc(sizeof(idevice_activation_multi));
+
+	if (!tmp_multi) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
 	}
 
-	*response = tmp_response;
+	tmp_multi->handle = curl_multi_init();
+	if (!tmp_multi->handle) {
+		free(tmp_multi);
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	}
+	tmp_multi->transfers = NULL;
+	tmp_multi->http2 = 0;
+	*multi = tmp_multi;
 
-	return result;
+	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
 
-idevice_activation_error_t idevice_activation_response_to_buffer(idevice_activation_response_t response, char** buffer, size_t* size)
+static void idevice_activation_multi_transfer_free(idevice_activation_multi_t multi, struct idevice_activation_transfer* transfer)
 {
-	if (!response || !buffer || !size)
+	curl_multi_remove_handle(multi->handle, transfer->handle);
+	curl_easy_cleanup(transfer->handle);
+	idevice_activation_transfer_cleanup(transfer);
+	free(transfer);
+}
+
+idevice_activation_error_t idevice_activation_multi_set_http2(idevice_activation_multi_t multi, int enable, int max_streams)
+{
+	if (!multi || max_streams < 0)
 		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-	char* tmp_buffer = (char*) malloc(sizeof(char) * response->raw_content_size);
-	if (!tmp_buffer) {
-		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	if (!enable) {
+		multi->http2 = 0;
+#if LIBCURL_VERSION_NUM >= 0x072b00
+		curl_multi_setopt(multi->handle, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
+#endif
+		return IDEVICE_ACTIVATION_E_SUCCESS;
 	}
 
-	memcpy(tmp_buffer, response->raw_content, response->raw_content_size);
-
-	*buffer = tmp_buffer;
-	*size = response->raw_content_size;
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+	if (!info || !(info->features & CURL_VERSION_HTTP2)) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: libcurl was built without HTTP/2 support\n", __func__);
+		return IDEVICE_ACTIVATION_E_NOT_SUPPORTED;
+	}
 
-	return IDEVICE_ACTIVATION_E_SUCCESS;
-}
+#if LIBCURL_VERSION_NUM < 0x074300
+	// CURLMOPT_MAX_CONCURRENT_STREAMS needs libcurl 7.67.0
+	if (max_streams > 0) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: libcurl is too old to limit the number of streams\n", __func__);
+		return IDEVICE_ACTIVATION_E_NOT_SUPPORTED;
+	}
+#endif
 
-void idevice_activation_response_free(idevice_activation_response_t response)
-{
-	if (!response)
-		return;
+	curl_multi_setopt(multi->handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+	if (max_streams > 0) {
+		curl_multi_setopt(multi->handle, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)max_streams);
+	}
+#endif
+	multi->http2 = 1;
 
-	free(response->raw_content);
-	free(response->title);
-	free(response->description);
-	plist_free(response->activation_record);
-	plist_free(response->headers);
-	plist_free(response->fields);
-	plist_free(response->fields_require_input);
-	plist_free(response->fields_secure_input);
-	plist_free(response->labels);
-	plist_free(response->labels_placeholder);
-	free(response);
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+#else
+	return IDEVICE_ACTIVATION_E_NOT_SUPPORTED;
+#endif
 }
 
-void idevice_activation_response_get_field(idevice_activation_response_t response, const char* key, char** value)
+void idevice_activation_multi_free(idevice_activation_multi_t multi)
 {
-	if (!response || !key || !value)
+	if (!multi)
 		return;
 
-	*value = NULL;
-	plist_t item = plist_dict_get_item(response->fields, key);
-
-	if (item && plist_get_node_type(item) == PLIST_STRING) {
-		plist_get_string_val(item, value);
+	// pending requests are dropped without invoking their callbacks
+	while (multi->transfers) {
+		struct idevice_activation_transfer* transfer = multi->transfers;
+		multi->transfers = transfer->next;
+		idevice_activation_multi_transfer_free(multi, transfer);
 	}
+	curl_multi_cleanup(multi->handle);
+	free(multi);
 }
 
-void idevice_activation_response_get_fields(idevice_activation_response_t response, plist_t* fields)
+idevice_activation_error_t idevice_activation_send_request_async(idevice_activation_multi_t multi, idevice_activation_request_t request, idevice_activation_request_cb_t callback, void* userdata)
 {
-	if (response && response->fields && fields) {
-		*fields = plist_copy(response->fields);
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+
+	// check arguments
+	if (!multi || !request || !callback) {
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 	}
-}
 
-void idevice_activation_response_get_label(idevice_activation_response_t response, const char* key, char** value)
-{
-	if (!response || !key || !value)
-		return;
+	struct idevice_activation_transfer* transfer = (struct idevice_activation_transfer*) calloc(1, sizeof(struct idevice_activation_transfer));
+	if (!transfer) {
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
+	}
 
-	*value = NULL;
-	plist_t item = plist_dict_get_item(response->labels, key);
-	if (item) {
-		plist_get_string_val(item, value);
+	transfer->handle = curl_easy_init();
+	if (!transfer->handle) {
+		free(transfer);
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 	}
-}
+	transfer->request = request;
+	transfer->callback = callback;
+	transfer->userdata = userdata;
 
-void idevice_activation_response_get_placeholder(idevice_activation_response_t response, const char* key, char** value)
-{
-	if (!response || !key || !value)
-		return;
+	result = idevice_activation_transfer_prepare(transfer, request);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		goto error;
+	}
+	curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, transfer);
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	if (multi->http2) {
+		// wait for an existing connection to multiplex on rather than
+		// opening a new one for every request to the same host
+#if LIBCURL_VERSION_NUM >= 0x072f00
+		curl_easy_setopt(transfer->handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#else
+		curl_easy_setopt(transfer->handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+#endif
+		curl_easy_setopt(transfer->handle, CURLOPT_PIPEWAIT, 1L);
+	}
+#endif
 
-	*value = NULL;
-	plist_t item = plist_dict_get_item(response->labels_placeholder, key);
-	if (item) {
-		plist_get_string_val(item, value);
+	if (curl_multi_add_handle(multi->handle, transfer->handle) != CURLM_OK) {
+		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		goto error;
 	}
-}
 
-void idevice_activation_response_get_title(idevice_activation_response_t response, const char** title)
-{
-	if (!response || !title)
-		return;
+	transfer->next = multi->transfers;
+	multi->transfers = transfer;
 
-	*title = response->title;
-}
+	return IDEVICE_ACTIVATION_E_SUCCESS;
 
-void idevice_activation_response_get_description(idevice_activation_response_t response, const char** description)
-{
-	if (!response || !description)
-		return;
+error:
+	curl_easy_cleanup(transfer->handle);
+	idevice_activation_transfer_cleanup(transfer);
+	free(transfer);
 
-	*description = response->description;
+	return result;
 }
 
-void idevice_activation_response_get_activation_record(idevice_activation_response_t response, plist_t* activation_record)
+static void idevice_activation_multi_complete(idevice_activation_multi_t multi, struct idevice_activation_transfer* transfer, CURLcode code)
 {
-	if (!response || !activation_record)
-		return;
+	struct idevice_activation_transfer** link = &multi->transfers;
+	idevice_activation_response_t response = NULL;
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
 
-	if (response->activation_record) {
-		*activation_record = plist_copy(response->activation_record);
+	// unlink first so the callback is free to queue follow-up requests
+	while (*link && *link != transfer) {
+		link = &(*link)->next;
+	}
+	if (*link) {
+		*link = transfer->next;
+	}
+
+	if (code != CURLE_OK) {
+		if (debug_level > 0)
+			fprintf(stderr, "%s: %s\n", __func__, curl_easy_strerror(code));
+		result = idevice_activation_error_from_curl(code);
+	} else if (transfer->request->lazy_parse) {
+		transfer->response->parse_pending = 1;
 	} else {
-		*activation_record = NULL;
+		result = idevice_activation_parse_raw_response(transfer->response);
+	}
+	if (result == IDEVICE_ACTIVATION_E_SUCCESS) {
+		response = transfer->response;
+		transfer->response = NULL;
 	}
-}
 
-void idevice_activation_response_get_headers(idevice_activation_response_t response, plist_t* headers)
-{
-	if (!response || !headers)
-		return;
+	transfer->callback(transfer->request, result, response, transfer->userdata);
 
-	*headers = plist_copy(response->headers);
+	idevice_activation_multi_transfer_free(multi, transfer);
 }
 
-int idevice_activation_response_is_activation_acknowledged(idevice_activation_response_t response)
+static void idevice_activation_multi_resume_waiting(idevice_activation_multi_t multi)
 {
-	if (!response)
-		return 0;
-
-	return response->is_activation_ack;
+	struct idevice_activation_transfer* transfer = multi->transfers;
+	uint64_t now = idevice_activation_get_time_ms();
+
+	while (transfer) {
+		struct idevice_activation_transfer* next = transfer->next;
+		if (transfer->waiting) {
+			idevice_activation_cancel_t cancel = transfer->request->cancel;
+			if (idevice_activation_cancel_is_triggered(cancel)) {
+				idevice_activation_multi_complete(multi, transfer, CURLE_ABORTED_BY_CALLBACK);
+			} else if (now >= transfer->retry_at) {
+				transfer->waiting = 0;
+				if (curl_multi_add_handle(multi->handle, transfer->handle) != CURLM_OK) {
+					idevice_activation_multi_complete(multi, transfer, CURLE_FAILED_INIT);
+				}
+			}
+		}
+		transfer = next;
+	}
 }
 
-int idevice_activation_response_is_authentication_required(idevice_activation_response_t response)
+idevice_activation_error_t idevice_activation_multi_perform(idevice_activation_multi_t multi, int* running)
 {
-	if (!response)
-		return 0;
+	int still_running = 0;
+	int msgs_left = 0;
+	CURLMsg* msg = NULL;
 
-	return response->is_auth_required;
-}
+	if (!multi)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-int idevice_activation_response_field_requires_input(idevice_activation_response_t response, const char* key)
-{
-	if (!response || !key)
-		return 0;
+	idevice_activation_multi_resume_waiting(multi);
 
-	return (plist_dict_get_item(response->fields_require_input, key) ? 1 : 0);
-}
+	if (curl_multi_perform(multi->handle, &still_running) != CURLM_OK) {
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	}
 
-int idevice_activation_response_field_secure_input(idevice_activation_response_t response, const char* key)
-{
-	if (!response || !key)
-		return 0;
+	while ((msg = curl_multi_info_read(multi->handle, &msgs_left))) {
+		if (msg->msg == CURLMSG_DONE) {
+			struct idevice_activation_transfer* transfer = NULL;
+			CURLcode code = msg->data.result;
+			unsigned int delay_ms = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+			if (!transfer) {
+				continue;
+			}
+			idevice_activation_transfer_collect_info(transfer);
+			if (idevice_activation_transfer_should_retry(transfer, code, &delay_ms)) {
+				// park the transfer until its backoff expired
+				curl_multi_remove_handle(multi->handle, transfer->handle);
+				if (idevice_activation_transfer_rearm(transfer) == IDEVICE_ACTIVATION_E_SUCCESS) {
+					transfer->waiting = 1;
+					transfer->retry_at = idevice_activation_get_time_ms() + delay_ms;
+					continue;
+				}
+				code = CURLE_OUT_OF_MEMORY;
+			}
+			idevice_activation_multi_complete(multi, transfer, code);
+		}
+	}
 
-	return (plist_dict_get_item(response->fields_secure_input, key) ? 1 : 0);
+	if (running) {
+		// callbacks might have queued new requests in the meantime
+		*running = (multi->transfers != NULL) ? 1 : 0;
+	}
+
+	return IDEVICE_ACTIVATION_E_SUCCESS;
 }
 
-int idevice_activation_response_has_errors(idevice_activation_response_t response)
+idevice_activation_error_t idevice_activation_multi_poll(idevice_activation_multi_t multi, int timeout_ms, int* running)
 {
-	if (!response)
-		return 0;
+	if (!multi)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-	return response->has_errors;
+	if (multi->transfers) {
+		struct idevice_activation_transfer* transfer = NULL;
+		int active = 0;
+		uint64_t now = idevice_activation_get_time_ms();
+
+		// don't sleep past the end of a retry backoff
+		for (transfer = multi->transfers; transfer; transfer = transfer->next) {
+			if (!transfer->waiting) {
+				active = 1;
+			} else if (transfer->retry_at <= now) {
+				timeout_ms = 0;
+			} else if (transfer->retry_at - now < (uint64_t)timeout_ms) {
+				timeout_ms = (int)(transfer->retry_at - now);
+			}
+		}
+		if (!active) {
+			if (timeout_ms > 0) {
+				idevice_activation_sleep_ms(timeout_ms);
+			}
+			return idevice_activation_multi_perform(multi, running);
+		}
+#if LIBCURL_VERSION_NUM >= 0x071c00
+		if (curl_multi_wait(multi->handle, NULL, 0, timeout_ms, NULL) != CURLM_OK) {
+			return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		}
+#else
+		fd_set fdread;
+		fd_set fdwrite;
+		fd_set fdexcep;
+		int maxfd = -1;
+		FD_ZERO(&fdread);
+		FD_ZERO(&fdwrite);
+		FD_ZERO(&fdexcep);
+		if (curl_multi_fdset(multi->handle, &fdread, &fdwrite, &fdexcep, &maxfd) != CURLM_OK) {
+			return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		}
+		if (maxfd >= 0) {
+			struct timeval tv;
+			tv.tv_sec = timeout_ms / 1000;
+			tv.tv_usec = (timeout_ms % 1000) * 1000;
+			select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &tv);
+		}
+#endif
+	}
+
+	return idevice_activation_multi_perform(multi, running);
 }
 
-idevice_activation_error_t idevice_activation_send_request(idevice_activation_request_t request, idevice_activation_response_t* response)
+#ifdef IDEVICE_ACTIVATION_TEST_HOOKS
+/* Entry point for bench/, runs the parser on a canned body as if it had
+ * been received with the given Content-Type header value. The response is
+ * handed out even if parsing fails and has to be freed by the caller. */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_test_parse_raw_response(const char* content, size_t size, const char* content_type, idevice_activation_response_t* response);
+
+idevice_activation_error_t idevice_activation_test_parse_raw_response(const char* content, size_t size, const char* content_type, idevice_activation_response_t* response)
 {
+	idevice_activation_response_t tmp_response = NULL;
 	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
 
-	// check arguments
-	if (!request || !response) {
+	if (!content || !response)
 		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	result = idevice_activation_response_new(&tmp_response);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+		return result;
+
+	if (content_type) {
+		char header[256];
+		int len = snprintf(header, sizeof(header), "Content-Type: %s\r\n", content_type);
+		if (len > 0 && (size_t)len < sizeof(header)) {
+			idevice_activation_header_callback(header, 1, len, tmp_response);
+		}
+	}
+	if (idevice_activation_write_callback((char*) content, 1, size, tmp_response) != size) {
+		idevice_activation_response_free(tmp_response);
+		return IDEVICE_ACTIVATION_E_OUT_OF_MEMORY;
 	}
 
-	plist_dict_iter iter = NULL;
-	plist_dict_new_iter(request->fields, &iter);
-	if (!iter) {
+	result = idevice_activation_parse_raw_response(tmp_response);
+	*response = tmp_response;
+
+	return result;
+}
+
+/* Serializes node with the writer used for non-string request fields,
+ * so bench/ can compare it with plist_to_xml(). */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_test_plist_write_xml(plist_t node, char** xml, size_t* size);
+
+idevice_activation_error_t idevice_activation_test_plist_write_xml(plist_t node, char** xml, size_t* size)
+{
+	struct idevice_activation_buffer buf = { NULL, 0, 0 };
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+
+	if (!node || !xml || !size)
 		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+
+	result = idevice_activation_plist_write_xml(&buf, node, 0);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+		free(buf.data);
+		return result;
 	}
+	*xml = buf.data;
+	*size = buf.size;
 
-	CURL* handle = curl_easy_init();
-	struct curl_httppost* form = NULL;
-	struct curl_slist* slist = NULL;
+	return IDEVICE_ACTIVATION_E_SUCCESS;
+}
 
-	if (!handle) {
-		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
-		goto cleanup;
-	}
+/* Runs only one of the two buddyml parsers, the tree walk or the XPath
+ * based one, so bench/ can compare their results. */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_test_parse_buddyml(const char* content, size_t size, int use_xpath, idevice_activation_response_t* response);
 
-	switch (request->client_type) {
-		case IDEVICE_ACTIVATION_CLIENT_MOBILE_ACTIVATION:
-			curl_easy_setopt(handle, CURLOPT_USERAGENT, IDEVICE_ACTIVATION_USER_AGENT_IOS);
-			break;
-		case IDEVICE_ACTIVATION_CLIENT_ITUNES:
-			curl_easy_setopt(handle, CURLOPT_USERAGENT, IDEVICE_ACTIVATION_USER_AGENT_ITUNES);
-			break;
-		default:
-			result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
-			goto cleanup;
-	}
+idevice_activation_error_t idevice_activation_test_parse_buddyml(const char* content, size_t size, int use_xpath, idevice_activation_response_t* response)
+{
+	idevice_activation_response_t tmp_response = NULL;
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	xmlDocPtr doc = NULL;
 
-	char* key = NULL;
-	char* svalue = NULL;
-	plist_t value_node = NULL;
+	if (!content || !response)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-	if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_MULTIPART_FORMDATA) {
-		struct curl_httppost* last = NULL;
-		do {
-			plist_dict_next_item(request->fields, iter, &key, &value_node);
-			if (key != NULL) {
-				if (value_node != NULL) {
-					// serialize plist node as field value
-					if (plist_get_node_type(value_node) == PLIST_STRING) {
-						plist_get_string_val(value_node, &svalue);
-					} else {
-						uint32_t data_size = 0;
-						plist_to_xml(value_node, &svalue, &data_size);
-						plist_strip_xml(&svalue);
-					}
+	result = idevice_activation_response_new(&tmp_response);
+	if (result != IDEVICE_ACTIVATION_E_SUCCESS)
+		return result;
 
-					curl_formadd(&form, &last, CURLFORM_COPYNAME, key, CURLFORM_COPYCONTENTS, svalue, CURLFORM_END);
+	tmp_response->content_type = IDEVICE_ACTIVATION_CONTENT_TYPE_BUDDYML;
+	doc = xmlReadMemory(content, size, "ideviceactivation.xml", NULL, idevice_activation_xml_parse_options(tmp_response->content_type));
+	if (!doc) {
+		result = IDEVICE_ACTIVATION_E_BUDDYML_PARSING_ERROR;
+	} else if (use_xpath) {
+		result = idevice_activation_parse_buddyml_xpath(tmp_response, doc);
+	} else {
+		result = idevice_activation_parse_buddyml_single_pass(tmp_response, doc);
+	}
+	xmlFreeDoc(doc);
+	*response = tmp_response;
 
-					free(svalue);
-					svalue = NULL;
-				}
-			}
-		} while(value_node != NULL);
-		curl_easy_setopt(handle, CURLOPT_HTTPPOST, form);
+	return result;
+}
 
-	} else if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_URL_ENCODED) {
-		char* postdata = (char*) malloc(sizeof(char));
-		postdata[0] = '\0';
-		do {
-			plist_dict_next_item(request->fields, iter, &key, &value_node);
-			if (key != NULL) {
-				if (value_node != NULL) {
-					// serialize plist node as field value
-					if (plist_get_node_type(value_node) == PLIST_STRING) {
-						plist_get_string_val(value_node, &svalue);
-					} else {
-						// only strings supported
-						free(postdata);
-						result = IDEVICE_ACTIVATION_E_UNSUPPORTED_FIELD_TYPE;
-						goto cleanup;
-					}
+/* Builds the plist embedded in an HTML reply either straight from the
+ * parsed nodes or, with use_dump, the way it used to be done by dumping
+ * the subtree and running plist_from_xml() on it, so bench/ can compare
+ * the two. */
+IDEVICE_ACTIVATION_API idevice_activation_error_t idevice_activation_test_parse_html_plist(const char* content, size_t size, int use_dump, plist_t* plist);
 
-					char* value_encoded = urlencode(svalue);
-					if (value_encoded) {
-						const size_t new_size = strlen(postdata) + strlen(key) + strlen(value_encoded) + 3;
-						postdata = (char*) realloc(postdata, new_size);
-						sprintf(&postdata[strlen(postdata)], "%s=%s&", key, value_encoded);
-						free(value_encoded);
-					}
+idevice_activation_error_t idevice_activation_test_parse_html_plist(const char* content, size_t size, int use_dump, plist_t* plist)
+{
+	idevice_activation_error_t result = IDEVICE_ACTIVATION_E_SUCCESS;
+	xmlDocPtr doc = NULL;
+	xmlXPathContextPtr context = NULL;
+	xmlXPathObjectPtr xpath_result = NULL;
+	xmlBufferPtr buffer = NULL;
+	xmlNodePtr node = NULL;
 
-					free(svalue);
-					svalue = NULL;
-				}
-			}
-		} while(value_node != NULL);
+	if (!content || !plist)
+		return IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
 
-		// remove the last '&'
-		const size_t postdata_len = strlen(postdata);
-		if (postdata_len > 0)
-			postdata[postdata_len - 1] = '\0';
+	*plist = NULL;
 
-		curl_easy_setopt(handle, CURLOPT_POST, 1);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, postdata);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, strlen(postdata));
-	} else if (request->content_type == IDEVICE_ACTIVATION_CONTENT_TYPE_PLIST) {
-		char *postdata = NULL;
-		uint32_t postdata_len = 0;
-		plist_to_xml(request->fields, &postdata, &postdata_len);
-		curl_easy_setopt(handle, CURLOPT_POST, 1);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, postdata);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, postdata_len);
-		slist = curl_slist_append(NULL, "Content-Type: application/x-apple-plist");
-		slist = curl_slist_append(slist, "Accept: application/xml");
-		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, slist);
-	}
-	else {
-		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+	doc = xmlReadMemory(content, size, "ideviceactivation.xml", NULL, idevice_activation_xml_parse_options(IDEVICE_ACTIVATION_CONTENT_TYPE_HTML));
+	if (!doc) {
+		result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
 		goto cleanup;
 	}
 
-	idevice_activation_response_t tmp_response = NULL;
-	result = idevice_activation_response_new(&tmp_response);
-	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+	context = xmlXPathNewContext(doc);
+	if (!context) {
+		result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
 		goto cleanup;
 	}
 
-	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, tmp_response);
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &idevice_activation_write_callback);
-	curl_easy_setopt(handle, CURLOPT_HEADERDATA, tmp_response);
-	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &idevice_activation_header_callback);
-	curl_easy_setopt(handle, CURLOPT_URL, request->url);
-	curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1);
-	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
-
-	// enable communication debugging
-	if (debug_level > 0) {
-		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
-		curl_easy_setopt(handle, CURLOPT_DEBUGFUNCTION, idevice_activation_curl_debug_callback);
+	xpath_result = idevice_activation_xpath_eval(XPATH_HTML_PLIST, context);
+	if (!xpath_result) {
+		result = IDEVICE_ACTIVATION_E_INTERNAL_ERROR;
+		goto cleanup;
 	}
 
-	curl_easy_perform(handle);
-
-	result = idevice_activation_parse_raw_response(tmp_response);
-	if (result != IDEVICE_ACTIVATION_E_SUCCESS) {
+	if (!xpath_result->nodesetval || !xpath_result->nodesetval->nodeNr) {
+		result = IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
 		goto cleanup;
 	}
 
-	*response = tmp_response;
+	node = xpath_result->nodesetval->nodeTab[0];
+	if (use_dump) {
+		buffer = xmlBufferCreate();
+		if (!buffer || htmlNodeDump(buffer, doc, node) == -1) {
+			result = IDEVICE_ACTIVATION_E_HTML_PARSING_ERROR;
+			goto cleanup;
+		}
+		plist_from_xml((const char*) xmlBufferContent(buffer), xmlBufferLength(buffer), plist);
+	} else {
+		*plist = idevice_activation_plist_from_xml_node(node);
+	}
 
-	result = IDEVICE_ACTIVATION_E_SUCCESS;
+	if (!*plist) {
+		result = IDEVICE_ACTIVATION_E_PLIST_PARSING_ERROR;
+	}
 
 cleanup:
-	free(iter);
-	if (form)
-		curl_formfree(form);
-	if (slist)
-		curl_slist_free_all(slist);
-	if (handle)
-		curl_easy_cleanup(handle);
+	if (buffer)
+		xmlBufferFree(buffer);
+	if (xpath_result)
+		xmlXPathFreeObject(xpath_result);
+	if (context)
+		xmlXPathFreeContext(context);
+	if (doc)
+		xmlFreeDoc(doc);
 
 	return result;
 }
+#endif
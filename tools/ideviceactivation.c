@@ -47,6 +47,15 @@
 #include <termios.h>
 #endif
 
+/* ride out short server hiccups instead of failing the whole activation,
+ * only where the server cannot have acted on the request already */
+static const idevice_activation_retry_policy_t retry_policy = {
+	3,	/* max_attempts */
+	500,	/* base_backoff_ms */
+	8000,	/* max_backoff_ms */
+	IDEVICE_ACTIVATION_RETRY_ON_CONNECT_FAILURE | IDEVICE_ACTIVATION_RETRY_ON_RETRY_AFTER
+};
+
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -122,6 +131,7 @@ int main(int argc, char *argv[])
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
 	lockdownd_client_t lockdown = NULL;
 	mobileactivation_client_t ma = NULL;
+	idevice_activation_session_t session = NULL;
 	idevice_activation_request_t request = NULL;
 	idevice_activation_response_t response = NULL;
 	const char* response_title = NULL;
@@ -302,6 +312,13 @@ int main(int argc, char *argv[])
 			break;
 		case OP_ACTIVATE:
 		default:
+			/* keep one connection to the activation server for all requests */
+			if (idevice_activation_session_new(&session) != IDEVICE_ACTIVATION_E_SUCCESS) {
+				fprintf(stderr, "Failed to create activation session.\n");
+				result = EXIT_FAILURE;
+				goto cleanup;
+			}
+
 			if (use_mobileactivation) {
 				// create activation request from mobileactivation
 				plist_t ainfo = NULL;
@@ -333,6 +350,7 @@ int main(int argc, char *argv[])
 						goto cleanup;
 					}
 					idevice_activation_request_set_fields(request, blob);
+					idevice_activation_request_set_retry_policy(request, &retry_policy);
 					plist_free(blob);
 
 					if (signing_service_url) {
@@ -340,7 +358,7 @@ int main(int argc, char *argv[])
 					}
 
 					/* send request to server and get response */
-					if (idevice_activation_send_request(request, &response) != IDEVICE_ACTIVATION_E_SUCCESS) {
+					if (idevice_activation_session_send_request(session, request, &response) != IDEVICE_ACTIVATION_E_SUCCESS) {
 						fprintf(stderr, "Failed to get drmHandshake result from activation server.\n");
 						result = EXIT_FAILURE;
 						goto cleanup;
@@ -395,9 +413,10 @@ int main(int argc, char *argv[])
 			if (request && signing_service_url) {
 				idevice_activation_request_set_url(request, signing_service_url);
 			}
+			idevice_activation_request_set_retry_policy(request, &retry_policy);
 
 			while(1) {
-				if (idevice_activation_send_request(request, &response) != IDEVICE_ACTIVATION_E_SUCCESS) {
+				if (idevice_activation_session_send_request(session, request, &response) != IDEVICE_ACTIVATION_E_SUCCESS) {
 					fprintf(stderr, "Failed to send request or retrieve response.\n");
 					// Here response might have some content that could't be correctly interpreted (parsed)
 					// by the library. Printing out the content could help to identify the cause of the error.
@@ -421,7 +440,7 @@ int main(int argc, char *argv[])
 					goto cleanup;
 				}
 
-				idevice_activation_response_get_activation_record(response, &record);
+				idevice_activation_response_take_activation_record(response, &record);
 
 				if (record) {
 					if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(device, &lockdown, "ideviceactivation")) {
@@ -533,6 +552,7 @@ int main(int argc, char *argv[])
 					}
 
 					idevice_activation_request_set_fields_from_response(request, response);
+					idevice_activation_request_set_retry_policy(request, &retry_policy);
 
 					int interactive_count = 0;
 					do {
@@ -611,6 +631,9 @@ cleanup:
 	if (response)
 		idevice_activation_response_free(response);
 
+	if (session)
+		idevice_activation_session_free(session);
+
 	if (fields)
 		plist_free(fields);
 